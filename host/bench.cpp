@@ -0,0 +1,110 @@
+// Microbenchmarks for the version2 firmware, run natively
+//
+// The whole firmware is compiled into this translation unit against the stubs
+// in stubs/, so the benchmarks call the real alarm engine, button state machine
+// and servo law. Time is the simulated hostMillis clock from stubs/Arduino.h;
+// only the measurements use the host's steady clock.
+//
+//   medibox_bench [scale]    scale multiplies every run count (default 1)
+
+#include "main.cpp"
+
+#include <chrono>
+
+#define BENCH_EPOCH 1760000000UL  // Fixed start so alarm positions do not depend on the date
+
+volatile long benchSink = 0;  // Keeps results live so the loops are not optimised away
+
+template <class Body>
+void bench(const char* name, long runs, Body body) {
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < runs; i++) body(i);
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  printf("%-20s %10ld runs %12.1f ns/run\n", name, runs, elapsed.count() / runs);
+}
+
+// Full table, so reschedule and reposition work on MAX_ALARMS entries
+void fillAlarms() {
+  alarmCount = 0;
+  for (int i = 0; i < MAX_ALARMS; i++) {
+    insertAlarm(freeAlarmId(), (i * 7) % 24, (i * 13) % 60, ALARM_EVERY_DAY, BENCH_EPOCH);
+  }
+}
+
+void benchAlarms(long scale) {
+  fillAlarms();
+  uint32_t notDue = alarms[0].nextDue - 64;
+  bench("dueAlarm", 10000000 * scale, [&](long i) {
+    int missedId;
+    benchSink += dueAlarm(notDue - (i & 63), missedId);
+  });
+  bench("rescheduleAlarms", 20000 * scale, [&](long i) {
+    rescheduleAlarms(BENCH_EPOCH + i * 60, 0);
+  });
+  alarmCount = 0;
+}
+
+// One lap of the menu and the alarm editor that ends back on SHOW_TIME without saving
+const uint8_t buttonLap[] = {
+  BUTTON_RIGHT, BUTTON_DOWN, BUTTON_UP,                         // Main menu
+  BUTTON_RIGHT, BUTTON_UP, BUTTON_UP, BUTTON_DOWN,              // Add Alarm: hour
+  BUTTON_RIGHT, BUTTON_UP, BUTTON_DOWN,                         // Minute
+  BUTTON_LEFT, BUTTON_LEFT,                                     // Back out
+};
+const int buttonLapLength = sizeof(buttonLap) / sizeof(buttonLap[0]);
+
+void benchButtons(long scale) {
+  currentState = SHOW_TIME;
+  bench("dispatchButton", 10000000 * scale, [](long i) {
+    dispatchButton(buttonLap[i % buttonLapLength]);
+    benchSink += currentState;
+  });
+  currentState = SHOW_TIME;
+}
+
+void benchServo(long scale) {
+  envSnapshot.temperature = 30;
+  envSnapshot.valid = true;
+  lightSnapshot.valid = true;
+  bench("updateServoLaw", 10000000 * scale, [](long i) {
+    T_med = 20 + (i & 15);
+    updateServoLaw();
+    benchSink += (long)servoGain;
+  });
+  T_med = 30;
+  updateServoLaw();
+  bench("adjustServo", 10000000 * scale, [](long i) {
+    lightSnapshot.level = (i % 100) / 100.0f;  // Sweeps the whole range, so the servo moves
+    hostMillis += 500;
+    adjustServo();
+    benchSink += (long)servoAngle;
+  });
+}
+
+// A simulated hour of the whole firmware: every scheduler task at its own period
+void benchScheduler(long scale) {
+  for (long hour = 0; hour < scale; hour++) {
+    long passes = 0;
+    unsigned long end = hostMillis + 3600000UL;
+    auto start = std::chrono::steady_clock::now();
+    while ((long)(hostMillis - end) < 0) {
+      hostTemperature = 28 + 6 * sinf(hostMillis / 600000.0f);  // Drifts out of range and back
+      loop();
+      passes++;
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    printf("%-20s %10ld runs %12.1f ms per simulated hour\n", "loop", passes, elapsed.count());
+  }
+}
+
+int main(int argc, char** argv) {
+  long scale = argc > 1 ? atol(argv[1]) : 1;
+  if (scale < 1) scale = 1;
+
+  setup();
+  benchAlarms(scale);
+  benchButtons(scale);
+  benchServo(scale);
+  benchScheduler(scale);
+  return 0;
+}
@@ -0,0 +1,49 @@
+// Host stand-in for Adafruit_SSD1306: a real frame buffer, nothing behind it
+
+#ifndef MEDIBOX_HOST_SSD1306_H
+#define MEDIBOX_HOST_SSD1306_H
+
+#include <Wire.h>
+
+#define SSD1306_SWITCHCAPVCC 0x02
+#define SSD1306_BLACK 0
+#define SSD1306_WHITE 1
+#define SSD1306_COLUMNADDR 0x21
+#define SSD1306_PAGEADDR 0x22
+#define SSD1306_DISPLAYOFF 0xAE
+#define SSD1306_DISPLAYON 0xAF
+
+class Adafruit_GFX : public Print {
+ public:
+  Adafruit_GFX(int16_t width, int16_t height) : width_(width), height_(height) {}
+  void setCursor(int16_t x, int16_t y) { cursorX_ = x; cursorY_ = y; }
+  void setTextSize(uint8_t) {}
+  void setTextColor(uint16_t) {}
+  void setTextColor(uint16_t, uint16_t) {}
+  void drawFastHLine(int16_t, int16_t, int16_t, uint16_t) {}
+  void fillRect(int16_t, int16_t, int16_t, int16_t, uint16_t) {}
+  int16_t width() const { return width_; }
+  int16_t height() const { return height_; }
+  int16_t getCursorX() const { return cursorX_; }
+  int16_t getCursorY() const { return cursorY_; }
+ protected:
+  int16_t width_, height_;
+  int16_t cursorX_ = 0, cursorY_ = 0;
+};
+
+class Adafruit_SSD1306 : public Adafruit_GFX {
+ public:
+  Adafruit_SSD1306(uint8_t width, uint8_t height, TwoWire*, int8_t = -1)
+      : Adafruit_GFX(width, height) {}
+  bool begin(uint8_t = SSD1306_SWITCHCAPVCC, uint8_t = 0, bool = true, bool = true) { return true; }
+  void clearDisplay() { memset(buffer_, 0, sizeof(buffer_)); }
+  void display() {}
+  uint8_t* getBuffer() { return buffer_; }
+  void ssd1306_command(uint8_t) {}
+  void dim(bool) {}
+  void invertDisplay(bool) {}
+ private:
+  uint8_t buffer_[128 * 64 / 8] = {};
+};
+
+#endif
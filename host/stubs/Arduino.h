@@ -0,0 +1,187 @@
+// Host stand-in for the Arduino-ESP32 core
+//
+// Just enough of the API for the firmware to compile and run natively. Time is
+// simulated: millis() reads hostMillis, which only delay() (and the harness)
+// moves forward, so scheduler runs are repeatable. Serial and every other
+// output is discarded.
+
+#ifndef MEDIBOX_HOST_ARDUINO_H
+#define MEDIBOX_HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <string>
+
+using std::min;
+using std::max;
+
+#define IRAM_ATTR
+#define ARDUINO_ISR_ATTR
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
+#define HIGH 1
+#define LOW 0
+#define INPUT 1
+#define OUTPUT 3
+#define INPUT_PULLUP 5
+#define RISING 1
+#define FALLING 2
+#define CHANGE 3
+#define DEC 10
+#define HEX 16
+#define ESP_ARDUINO_VERSION_MAJOR 3
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+template <class T, class L, class H>
+auto constrain(T value, L low, H high) -> decltype(value + low) {
+  return value < low ? low : (value > high ? high : value);
+}
+
+// Simulated clocks and pins
+inline unsigned long hostMillis = 0;
+inline int hostPinLevel[40] = {};  // Read back by digitalRead(); 0 = LOW
+inline uint16_t hostAnalogValue = 2048;
+
+inline unsigned long millis() { return hostMillis; }
+inline unsigned long micros() { return hostMillis * 1000UL; }
+inline void delay(unsigned long ms) { hostMillis += ms; }
+inline void delayMicroseconds(unsigned) {}
+inline void yield() {}
+inline long random(long high) { return high > 0 ? rand() % high : 0; }
+inline long random(long low, long high) { return low + random(high - low); }
+
+inline void pinMode(uint8_t pin, uint8_t mode) {
+  if (pin < 40 && mode == INPUT_PULLUP) hostPinLevel[pin] = HIGH;
+}
+inline void digitalWrite(uint8_t pin, uint8_t level) { if (pin < 40) hostPinLevel[pin] = level; }
+inline int digitalRead(uint8_t pin) { return pin < 40 ? hostPinLevel[pin] : LOW; }
+inline uint16_t analogRead(uint8_t) { return hostAnalogValue; }
+inline void analogReadResolution(uint8_t) {}
+inline int digitalPinToInterrupt(int pin) { return pin; }
+inline void attachInterrupt(uint8_t, void (*)(void), int) {}
+inline void detachInterrupt(uint8_t) {}
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+inline char* dtostrf(double value, signed char width, unsigned char precision, char* out) {
+  sprintf(out, "%*.*f", width, precision, value);
+  return out;
+}
+
+class String {
+ public:
+  String(const char* text = "") : text_(text) {}
+  String(int value) : text_(std::to_string(value)) {}
+  const char* c_str() const { return text_.c_str(); }
+  unsigned length() const { return text_.size(); }
+  String& operator+=(const char* text) { text_ += text; return *this; }
+ private:
+  std::string text_;
+};
+
+class IPAddress {
+ public:
+  IPAddress() : address_(0) {}
+  IPAddress(uint32_t address) : address_(address) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+      : address_(a | b << 8 | c << 16 | (uint32_t)d << 24) {}
+  operator uint32_t() const { return address_; }
+  String toString() const { return String("0.0.0.0"); }
+ private:
+  uint32_t address_;
+};
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t) { return 1; }
+  size_t write(const uint8_t*, size_t length) { return length; }
+  template <class T> size_t print(const T&) { return 0; }
+  template <class T> size_t print(const T&, int) { return 0; }
+  template <class T> size_t println(const T&) { return 0; }
+  template <class T> size_t println(const T&, int) { return 0; }
+  size_t println() { return 0; }
+  size_t printf(const char*, ...) { return 0; }
+};
+
+class Stream : public Print {
+ public:
+  int available() { return 0; }
+  int read() { return -1; }
+  void setTimeout(unsigned long) {}
+};
+
+class HardwareSerial : public Stream {
+ public:
+  void begin(unsigned long) {}
+  void flush() {}
+  operator bool() const { return true; }
+};
+inline HardwareSerial Serial;
+
+class EspClass {
+ public:
+  uint32_t getFreeHeap() { return 200000; }
+  uint32_t getMinFreeHeap() { return 200000; }
+  uint32_t getMaxAllocHeap() { return 100000; }
+  uint32_t getCycleCount() { return (uint32_t)clock(); }
+  uint64_t getEfuseMac() { return 0x0000A1B2C3D4E5F6ULL; }
+  uint32_t getCpuFreqMHz() { return 240; }
+  void restart() { exit(0); }
+};
+inline EspClass ESP;
+
+// LEDC (arduino-esp32 v3)
+inline bool ledcAttach(uint8_t, uint32_t, uint8_t) { return true; }
+inline bool ledcWrite(uint8_t, uint32_t) { return true; }
+inline bool ledcDetach(uint8_t) { return true; }
+
+// ADC continuous mode
+typedef enum { ADC_0db, ADC_2_5db, ADC_6db, ADC_11db } adc_attenuation_t;
+typedef struct { uint8_t pin; uint8_t channel; int avg_read_raw; int avg_read_mvolts; } adc_continuous_data_t;
+inline bool analogContinuous(const uint8_t[], size_t, uint32_t, uint32_t, void (*)(void)) { return false; }
+inline bool analogContinuousRead(adc_continuous_data_t**, uint32_t) { return false; }
+inline bool analogContinuousStart() { return false; }
+inline bool analogContinuousStop() { return true; }
+inline void analogContinuousSetWidth(uint8_t) {}
+inline void analogContinuousSetAtten(adc_attenuation_t) {}
+
+// FreeRTOS: there is no second core on the host, tasks are never started
+typedef void* TaskHandle_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+#define pdPASS 1
+#define pdMS_TO_TICKS(x) (x)
+#define portMAX_DELAY 0xffffffff
+inline BaseType_t xTaskCreatePinnedToCore(void (*)(void*), const char*, uint32_t, void*,
+                                          UBaseType_t, TaskHandle_t*, BaseType_t) { return 0; }
+inline void vTaskDelay(TickType_t ticks) { delay(ticks); }
+inline UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t) { return 0; }
+
+// ESP-IDF
+typedef int esp_err_t;
+#define ESP_OK 0
+typedef enum { ESP_RST_UNKNOWN, ESP_RST_POWERON, ESP_RST_EXT, ESP_RST_SW, ESP_RST_PANIC,
+               ESP_RST_INT_WDT, ESP_RST_TASK_WDT, ESP_RST_WDT, ESP_RST_DEEPSLEEP,
+               ESP_RST_BROWNOUT, ESP_RST_SDIO } esp_reset_reason_t;
+inline esp_reset_reason_t esp_reset_reason() { return ESP_RST_POWERON; }
+inline int64_t esp_timer_get_time() { return (int64_t)hostMillis * 1000; }
+
+// The zone rule is applied for localtime(); the wall clock itself is the host's
+inline void configTzTime(const char* tz, const char*, const char* = nullptr, const char* = nullptr) {
+  setenv("TZ", tz, 1);
+  tzset();
+}
+
+#endif
@@ -0,0 +1,30 @@
+// Host stand-in for DHTesp: returns hostTemperature/hostHumidity, which the
+// harness sets to replay a sensor trace
+
+#ifndef MEDIBOX_HOST_DHTESP_H
+#define MEDIBOX_HOST_DHTESP_H
+
+#include <Arduino.h>
+
+inline float hostTemperature = 28.0f;
+inline float hostHumidity = 72.0f;
+
+struct TempAndHumidity {
+  float temperature;
+  float humidity;
+};
+
+class DHTesp {
+ public:
+  enum DHT_MODEL_t { AUTO_DETECT, DHT11, DHT22, AM2302, RHT03 };
+  enum DHT_ERROR_t { ERROR_NONE = 0, ERROR_TIMEOUT, ERROR_CHECKSUM };
+  void setup(int, DHT_MODEL_t) {}
+  TempAndHumidity getTempAndHumidity() { return {hostTemperature, hostHumidity}; }
+  float getTemperature() { return hostTemperature; }
+  float getHumidity() { return hostHumidity; }
+  DHT_ERROR_t getStatus() { return ERROR_NONE; }
+  const char* getStatusString() { return "OK"; }
+  int getMinimumSamplingPeriod() { return 1000; }  // DHT11
+};
+
+#endif
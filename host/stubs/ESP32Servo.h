@@ -0,0 +1,18 @@
+// Host stand-in for ESP32Servo; the last angle written is kept for the harness
+
+#ifndef MEDIBOX_HOST_ESP32SERVO_H
+#define MEDIBOX_HOST_ESP32SERVO_H
+
+#include <Arduino.h>
+
+class Servo {
+ public:
+  int attach(int) { return 1; }
+  void write(int angle) { angle_ = angle; }
+  int read() { return angle_; }
+  void detach() {}
+ private:
+  int angle_ = 0;
+};
+
+#endif
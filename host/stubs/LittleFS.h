@@ -0,0 +1,40 @@
+// Host stand-in for LittleFS: mounting fails, so the telemetry store and the
+// trace stay disabled
+
+#ifndef MEDIBOX_HOST_LITTLEFS_H
+#define MEDIBOX_HOST_LITTLEFS_H
+
+#include <Arduino.h>
+
+namespace fs {
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+class File : public Stream {
+ public:
+  operator bool() const { return false; }
+  using Print::write;
+  size_t read(uint8_t*, size_t) { return 0; }
+  int read() { return -1; }
+  bool seek(uint32_t, SeekMode = SeekSet) { return false; }
+  size_t position() const { return 0; }
+  size_t size() const { return 0; }
+  void close() {}
+  void flush() {}
+};
+
+class LittleFSFS {
+ public:
+  bool begin(bool = false) { return false; }
+  File open(const char*, const char* = "r") { return File(); }
+  bool exists(const char*) { return false; }
+  bool remove(const char*) { return false; }
+  bool rename(const char*, const char*) { return false; }
+};
+
+}  // namespace fs
+
+using fs::File;
+inline fs::LittleFSFS LittleFS;
+
+#endif
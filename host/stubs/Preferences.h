@@ -0,0 +1,17 @@
+// Host stand-in for Preferences: NVS is always empty and writes are dropped,
+// so every run starts from the built-in settings
+
+#ifndef MEDIBOX_HOST_PREFERENCES_H
+#define MEDIBOX_HOST_PREFERENCES_H
+
+#include <Arduino.h>
+
+class Preferences {
+ public:
+  bool begin(const char*, bool = false, const char* = nullptr) { return true; }
+  void end() {}
+  size_t getBytes(const char*, void*, size_t) { return 0; }
+  size_t putBytes(const char*, const void*, size_t length) { return length; }
+};
+
+#endif
@@ -0,0 +1,31 @@
+// Host stand-in for PubSubClient: never connects, so every publish fails
+
+#ifndef MEDIBOX_HOST_PUBSUBCLIENT_H
+#define MEDIBOX_HOST_PUBSUBCLIENT_H
+
+#include <Arduino.h>
+
+class WiFiClient;
+
+class PubSubClient {
+ public:
+  PubSubClient(WiFiClient&) {}
+  PubSubClient& setServer(const char*, uint16_t) { return *this; }
+  PubSubClient& setCallback(void (*)(char*, uint8_t*, unsigned int)) { return *this; }
+  PubSubClient& setSocketTimeout(uint16_t) { return *this; }
+  PubSubClient& setKeepAlive(uint16_t) { return *this; }
+  bool setBufferSize(uint16_t) { return true; }
+  bool connect(const char*) { return false; }
+  bool connect(const char*, const char*, uint8_t, bool, const char*) { return false; }
+  void disconnect() {}
+  bool publish(const char*, const char*) { return false; }
+  bool publish(const char*, const char*, bool) { return false; }
+  bool publish(const char*, const uint8_t*, unsigned int) { return false; }
+  bool publish(const char*, const uint8_t*, unsigned int, bool) { return false; }
+  bool subscribe(const char*, uint8_t = 0) { return false; }
+  bool loop() { return false; }
+  bool connected() { return false; }
+  int state() { return -1; }
+};
+
+#endif
@@ -0,0 +1,45 @@
+// Host stand-in for the ESP32 WiFi library: the station never associates
+
+#ifndef MEDIBOX_HOST_WIFI_H
+#define MEDIBOX_HOST_WIFI_H
+
+#include <Arduino.h>
+
+#define WL_IDLE_STATUS 0
+#define WL_NO_SSID_AVAIL 1
+#define WL_CONNECTED 3
+#define WL_CONNECT_FAILED 4
+#define WL_DISCONNECTED 6
+#define WIFI_STA 1
+typedef int wl_status_t;
+typedef enum { WIFI_PS_NONE, WIFI_PS_MIN_MODEM, WIFI_PS_MAX_MODEM } wifi_ps_type_t;
+
+class WiFiClass {
+ public:
+  wl_status_t begin(const char*, const char* = nullptr, int32_t = 0, const uint8_t* = nullptr, bool = true) {
+    return WL_DISCONNECTED;
+  }
+  wl_status_t status() { return WL_DISCONNECTED; }
+  bool disconnect(bool = false, bool = false) { return true; }
+  bool mode(int) { return true; }
+  bool setSleep(bool) { return true; }
+  bool setSleep(wifi_ps_type_t) { return true; }
+  bool setAutoReconnect(bool) { return true; }
+  IPAddress localIP() { return IPAddress(); }
+  uint8_t* BSSID() { return bssid_; }
+  int32_t channel() { return 0; }
+  int32_t RSSI() { return 0; }
+  uint8_t* macAddress(uint8_t* mac) { memset(mac, 0, 6); return mac; }
+ private:
+  uint8_t bssid_[6] = {};
+};
+inline WiFiClass WiFi;
+
+class WiFiClient {
+ public:
+  int connect(const char*, uint16_t) { return 0; }
+  void setTimeout(uint32_t) {}
+  void setConnectionTimeout(uint32_t) {}
+};
+
+#endif
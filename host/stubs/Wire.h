@@ -0,0 +1,18 @@
+// Host stand-in for the ESP32 Wire library; transmissions are discarded
+
+#ifndef MEDIBOX_HOST_WIRE_H
+#define MEDIBOX_HOST_WIRE_H
+
+#include <Arduino.h>
+
+class TwoWire : public Stream {
+ public:
+  bool begin(int, int, uint32_t = 0) { return true; }
+  bool setClock(uint32_t) { return true; }
+  void beginTransmission(uint8_t) {}
+  uint8_t endTransmission(bool = true) { return 0; }
+  using Print::write;
+};
+inline TwoWire Wire;
+
+#endif
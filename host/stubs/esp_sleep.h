@@ -0,0 +1,18 @@
+// Host stand-in for IDF light sleep: sleeping until the timer advances the
+// simulated clock
+
+#ifndef MEDIBOX_HOST_ESP_SLEEP_H
+#define MEDIBOX_HOST_ESP_SLEEP_H
+
+#include <Arduino.h>
+
+typedef enum { ESP_SLEEP_WAKEUP_UNDEFINED, ESP_SLEEP_WAKEUP_TIMER, ESP_SLEEP_WAKEUP_GPIO } esp_sleep_wakeup_cause_t;
+
+inline uint64_t hostSleepTimer = 0;  // us
+
+inline esp_err_t esp_sleep_enable_timer_wakeup(uint64_t us) { hostSleepTimer = us; return ESP_OK; }
+inline esp_err_t esp_sleep_enable_gpio_wakeup() { return ESP_OK; }
+inline esp_err_t esp_light_sleep_start() { delay(hostSleepTimer / 1000); return ESP_OK; }
+inline esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause() { return ESP_SLEEP_WAKEUP_TIMER; }
+
+#endif
@@ -0,0 +1,13 @@
+// Host stand-in for the IDF SNTP client; the host clock needs no syncing
+
+#ifndef MEDIBOX_HOST_ESP_SNTP_H
+#define MEDIBOX_HOST_ESP_SNTP_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+typedef void (*sntp_sync_time_cb_t)(struct timeval* tv);
+inline void sntp_set_time_sync_notification_cb(sntp_sync_time_cb_t) {}
+inline void sntp_set_sync_interval(uint32_t) {}
+
+#endif
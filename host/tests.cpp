@@ -0,0 +1,141 @@
+// Correctness checks for the version2 firmware, run natively through ctest
+//
+// Like bench.cpp, the whole firmware is compiled into this translation unit
+// against the stubs in stubs/. Each failed check prints its line; the exit
+// status is the number of failures.
+
+#include "main.cpp"
+
+int testFailures = 0;
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition);     \
+      testFailures++;                                                          \
+    }                                                                          \
+  } while (0)
+
+#define TEST_DAY 1759968000UL  // 2025-10-09 00:00 UTC
+
+bool alarmsAscending() {
+  for (int i = 1; i < alarmCount; i++) {
+    if (alarms[i - 1].nextDue > alarms[i].nextDue) return false;
+  }
+  return true;
+}
+
+// Alarms added before the first SNTP sync all fall due on 1970-01-01; a sync
+// at 11:30 leaves 12:00 first and 10:00, 11:00 tomorrow
+void testRescheduleAfterFirstSync() {
+  alarmCount = 0;
+  insertAlarm(1, 10, 0, ALARM_EVERY_DAY, 1000);
+  insertAlarm(2, 11, 0, ALARM_EVERY_DAY, 1000);
+  insertAlarm(3, 12, 0, ALARM_EVERY_DAY, 1000);
+  uint32_t syncedAt = TEST_DAY + 11 * 3600 + 30 * 60;
+  rescheduleAlarms(syncedAt, 0);
+  CHECK(alarmsAscending());
+  CHECK(alarms[0].id == 3 && alarms[0].nextDue == syncedAt + 1800);
+  CHECK(alarms[1].id == 1 && alarms[2].id == 2);
+}
+
+// Snoozed alarms keep their deadlines, so this checks the sort on every rotation
+void testRescheduleRotatedTable() {
+  const int count = 8;
+  for (int rotation = 0; rotation < count; rotation++) {
+    alarmCount = count;
+    for (int i = 0; i < count; i++) {
+      alarms[i] = {(uint8_t)(i + 1), 0, 0, ALARM_EVERY_DAY, true,
+                   (uint32_t)(TEST_DAY + ((i + rotation) % count) * 60)};
+    }
+    rescheduleAlarms(TEST_DAY, 0);
+    CHECK(alarmsAscending());
+  }
+  alarmCount = 0;
+}
+
+// alarms/set arrives at least once and may be retained; repeats add nothing
+void testAlarmSetIsIdempotent() {
+  alarmCount = 0;
+  const char* message = "07:30";
+  for (int i = 0; i < 3; i++) applyAlarmMessage("set", message, message + strlen(message));
+  CHECK(alarmCount == 1);
+  const char* weekdays = "07:30,62";  // Same time on other days is a different alarm
+  applyAlarmMessage("set", weekdays, weekdays + strlen(weekdays));
+  CHECK(alarmCount == 2);
+  alarmCount = 0;
+}
+
+// Alarm fields are whole numbers in range; anything else changes nothing
+void testAlarmFieldParsing() {
+  const char* rejected[] = {"7.5:30", "07:30.5", "07:30,3.5", "-1:30", "24:00", "07:60", "07:30,0",
+                            "07:30,128", "07:", ":30", "07:30,", "07:30x"};
+  alarmCount = 0;
+  for (const char* message : rejected) {
+    applyAlarmMessage("set", message, message + strlen(message));
+    CHECK(alarmCount == 0);
+  }
+  const char* accepted = " 7 : 30 , 62 ";
+  applyAlarmMessage("set", accepted, accepted + strlen(accepted));
+  CHECK(alarmCount == 1 && alarms[0].hour == 7 && alarms[0].minute == 30 && alarms[0].days == 62);
+  const char* remove = "1.5";
+  applyAlarmMessage("delete", remove, remove + strlen(remove));
+  CHECK(alarmCount == 1);
+  remove = "1";
+  applyAlarmMessage("delete", remove, remove + strlen(remove));
+  CHECK(alarmCount == 0);
+}
+
+void testConfigNumberParsing() {
+  const char* text = " -12.5 ";
+  const char* p = text;
+  float value;
+  CHECK(parseConfigNumber(p, text + strlen(text), value) && p == text + strlen(text) && value == -12.5f);
+  text = "abc";
+  p = text;
+  CHECK(!parseConfigNumber(p, text + strlen(text), value));
+  text = "{\"minAngle\": 30, \"bogus\": 1}";  // One unknown key rejects the whole object
+  float staged[CONFIG_COUNT];
+  bool present[CONFIG_COUNT] = {};
+  CHECK(!parseConfigObject(text, text + strlen(text), staged, present));
+}
+
+// A tap shorter than DEBOUNCE_TIME loses its release edge; once the pin settles
+// the release is recovered, so the next press still gets through
+void testShortTapKeepsNextPress() {
+  ButtonEvent event;
+  while (buttonEventQueue.pop(event)) {}
+  uint8_t pin = buttonPins[BUTTON_UP];
+  hostMillis = 100000;
+
+  hostPinLevel[pin] = LOW;
+  handleButtonEdge(BUTTON_UP);
+  hostMillis += DEBOUNCE_TIME / 2;
+  hostPinLevel[pin] = HIGH;
+  handleButtonEdge(BUTTON_UP);  // Inside the window: dropped
+  hostMillis += DEBOUNCE_TIME;
+  CHECK(settleButton(BUTTON_UP, pin, event) && event.edge == EDGE_RELEASE);
+
+  hostMillis += DEBOUNCE_TIME;
+  hostPinLevel[pin] = LOW;
+  handleButtonEdge(BUTTON_UP);
+  int presses = 0;
+  while (buttonEventQueue.pop(event)) presses += event.edge == EDGE_PRESS;
+  CHECK(presses == 2);
+  hostPinLevel[pin] = HIGH;
+}
+
+int main() {
+  setenv("TZ", "UTC0", 1);
+  tzset();
+
+  testRescheduleAfterFirstSync();
+  testRescheduleRotatedTable();
+  testAlarmSetIsIdempotent();
+  testAlarmFieldParsing();
+  testConfigNumberParsing();
+  testShortTapKeepsNextPress();
+
+  printf("%d check(s) failed\n", testFailures);
+  return testFailures;
+}
@@ -0,0 +1,187 @@
+// Alarm engine
+// alarms[0..alarmCount) is kept sorted by nextDue, so the scheduler only ever
+// looks at alarms[0]. Reordering happens on add/delete/fire, not per tick.
+// Everything here works on UTC epochs; local time comes from the TZ rule in effect.
+
+#ifndef MEDIBOX_ALARMS_H
+#define MEDIBOX_ALARMS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef MAX_ALARMS
+#define MAX_ALARMS 32
+#endif
+#define ALARM_EVERY_DAY 0x7F       // Weekday mask, bit 0 = Sunday
+#define ALARM_MISSED_GRACE 300     // Seconds late an alarm may still ring (e.g. after a clock jump)
+
+struct Alarm {
+  uint8_t id;          // Stable handle for the UI and MQTT, 1..MAX_ALARMS
+  uint8_t hour;
+  uint8_t minute;
+  uint8_t days;
+  bool snoozed;        // nextDue is a snooze deadline rather than the schedule
+  uint32_t nextDue;    // UTC epoch
+};
+Alarm alarms[MAX_ALARMS];
+int alarmCount = 0;
+unsigned long alarmRevision = 0;   // Bumped on every table change, for the display
+
+// First time strictly after 'after' (UTC) that matches the alarm's local time and
+// weekdays. mktime() applies the zone's DST rule for each candidate day.
+uint32_t nextAlarmOccurrence(const Alarm& alarm, uint32_t after) {
+  time_t start = after;
+  struct tm today;
+  localtime_r(&start, &today);
+  for (int d = 0; d <= 7; d++) {
+    struct tm candidate = today;
+    candidate.tm_mday += d;
+    candidate.tm_hour = alarm.hour;
+    candidate.tm_min = alarm.minute;
+    candidate.tm_sec = 0;
+    candidate.tm_isdst = -1;
+    time_t due = mktime(&candidate);  // Normalises tm_mday and fills tm_wday
+    if ((uint32_t)due > after && (alarm.days & (1 << candidate.tm_wday))) {
+      return (uint32_t)due;
+    }
+  }
+  return UINT32_MAX;  // Empty weekday mask, never due
+}
+
+// Moves alarms[index] to its sorted position after its nextDue changed
+int repositionAlarm(int index) {
+  Alarm moved = alarms[index];
+  while (index > 0 && alarms[index - 1].nextDue > moved.nextDue) {
+    alarms[index] = alarms[index - 1];
+    index--;
+  }
+  while (index < alarmCount - 1 && alarms[index + 1].nextDue < moved.nextDue) {
+    alarms[index] = alarms[index + 1];
+    index++;
+  }
+  alarms[index] = moved;
+  alarmRevision++;
+  return index;
+}
+
+int findAlarm(int id) {
+  for (int i = 0; i < alarmCount; i++) {
+    if (alarms[i].id == id) return i;
+  }
+  return -1;
+}
+
+// Index of an alarm with exactly this schedule, or -1
+int findMatchingAlarm(int hour, int minute, int days) {
+  for (int i = 0; i < alarmCount; i++) {
+    if (alarms[i].hour == hour && alarms[i].minute == minute && alarms[i].days == days) return i;
+  }
+  return -1;
+}
+
+// Lowest id not in use, or 0 if the table is full
+int freeAlarmId() {
+  if (alarmCount == MAX_ALARMS) return 0;
+  int id = 1;
+  while (findAlarm(id) >= 0) id++;
+  return id;
+}
+
+// Returns the new alarm's index, or -1 if the table is full
+int insertAlarm(int id, int hour, int minute, int days, uint32_t now) {
+  if (alarmCount == MAX_ALARMS) return -1;
+
+  Alarm& alarm = alarms[alarmCount];
+  alarm.id = id;
+  alarm.hour = hour;
+  alarm.minute = minute;
+  alarm.days = days;
+  alarm.snoozed = false;
+  alarm.nextDue = nextAlarmOccurrence(alarm, now);
+  alarmCount++;
+  return repositionAlarm(alarmCount - 1);
+}
+
+void removeAlarm(int index) {
+  memmove(&alarms[index], &alarms[index + 1], sizeof(Alarm) * (alarmCount - index - 1));
+  alarmCount--;
+  alarmRevision++;
+}
+
+// Insertion sort by nextDue, for when many deadlines changed at once (each
+// element only moves left, so the sorted prefix grows by one per step)
+void sortAlarms() {
+  for (int i = 1; i < alarmCount; i++) {
+    Alarm moved = alarms[i];
+    int j = i;
+    while (j > 0 && alarms[j - 1].nextDue > moved.nextDue) {
+      alarms[j] = alarms[j - 1];
+      j--;
+    }
+    alarms[j] = moved;
+  }
+  alarmRevision++;
+}
+
+// Needed whenever the clock or time zone changes under the table.
+// keepId (the ringing alarm, or 0) keeps its deadline, as do snoozed alarms and
+// alarms that are due but not yet picked up by dueAlarm(), so a resync landing
+// between an alarm's due second and the next check cannot skip the dose.
+void rescheduleAlarms(uint32_t now, int keepId) {
+  for (int i = 0; i < alarmCount; i++) {
+    if (alarms[i].snoozed || alarms[i].id == keepId) continue;
+    uint32_t late = now - alarms[i].nextDue;
+    if ((int32_t)late >= 0 && late <= ALARM_MISSED_GRACE) continue;
+    alarms[i].nextDue = nextAlarmOccurrence(alarms[i], now);
+  }
+  sortAlarms();
+}
+
+// O(1) per tick: only the earliest alarm can be due. Returns the index of the
+// alarm that should ring (always 0), or -1. The ringing alarm stays at the head
+// until it is rearmed or snoozed. missedId is set to the id of an alarm that was
+// skipped for being too late, or 0, for the caller to log.
+int dueAlarm(uint32_t now, int& missedId) {
+  missedId = 0;
+  if (alarmCount == 0) return -1;
+  Alarm& head = alarms[0];
+  if ((int32_t)(now - head.nextDue) < 0) return -1;
+
+  if (now - head.nextDue > ALARM_MISSED_GRACE) {
+    // Too stale to be useful (clock jump, long outage); move on to the next dose time
+    missedId = head.id;
+    head.snoozed = false;
+    head.nextDue = nextAlarmOccurrence(head, now);
+    repositionAlarm(0);
+    return -1;
+  }
+  return 0;
+}
+
+// Back onto the schedule after ringing
+void rearmAlarm(int index, uint32_t now) {
+  alarms[index].snoozed = false;
+  alarms[index].nextDue = nextAlarmOccurrence(alarms[index], now);
+  repositionAlarm(index);
+}
+
+// Ring again at 'deadline' without touching the alarm's schedule
+void snoozeAlarmUntil(int index, uint32_t deadline) {
+  alarms[index].snoozed = true;
+  alarms[index].nextDue = deadline;
+  repositionAlarm(index);
+}
+
+// "#NN HH:MM SMTWTFS" with '-' for days the alarm is off
+void formatAlarm(char* buffer, const Alarm& alarm) {
+  const char* dayLetters = "SMTWTFS";
+  int length = sprintf(buffer, "#%-2d %02d:%02d ", alarm.id, alarm.hour, alarm.minute);
+  for (int day = 0; day < 7; day++) {
+    buffer[length++] = (alarm.days & (1 << day)) ? dayLetters[day] : '-';
+  }
+  buffer[length] = '\0';
+}
+
+#endif
@@ -0,0 +1,62 @@
+// Buttons
+// The pin ISRs debounce each edge and queue it with its timestamp; the firmware
+// drains buttonEventQueue from a scheduler task.
+
+#ifndef MEDIBOX_BUTTONS_H
+#define MEDIBOX_BUTTONS_H
+
+#include <Arduino.h>
+#include "MediBoxQueue.h"
+
+#ifndef DEBOUNCE_TIME
+#define DEBOUNCE_TIME 50        // Per-button, per-edge
+#endif
+
+enum ButtonId { BUTTON_UP, BUTTON_LEFT, BUTTON_DOWN, BUTTON_RIGHT, BUTTON_COUNT };
+
+enum ButtonEdge { EDGE_PRESS, EDGE_RELEASE };
+struct ButtonEvent {
+  uint8_t button;
+  uint8_t edge;
+  unsigned long time;  // millis() at the edge
+};
+SpscQueue<ButtonEvent, 32> buttonEventQueue;
+
+// Debounce state, owned by the ISRs (and settleButton() with interrupts off)
+volatile unsigned long lastEdgeTime[BUTTON_COUNT] = {0};    // Last accepted edge
+volatile unsigned long lastChangeTime[BUTTON_COUNT] = {0};  // Last edge of any kind
+volatile bool lastEdgePressed[BUTTON_COUNT] = {false};
+
+// Each button debounces on its own, so presses on different buttons never mask
+// each other. Returns false for bounces and repeated levels.
+bool IRAM_ATTR debounceButtonEdge(uint8_t button, bool pressed, unsigned long now) {
+  lastChangeTime[button] = now;
+  if (pressed == lastEdgePressed[button] || now - lastEdgeTime[button] < DEBOUNCE_TIME) {
+    return false;
+  }
+  lastEdgePressed[button] = pressed;
+  lastEdgeTime[button] = now;
+  return true;
+}
+
+// An edge inside the debounce window is dropped, so after a tap shorter than
+// DEBOUNCE_TIME the ISR would still think the button is down and throw away the
+// next press as a repeated level. The task draining the queue calls this for
+// each button: once the pin has been quiet for a full window, its level is
+// adopted and the missed edge returned in 'event'.
+bool settleButton(uint8_t button, uint8_t pin, ButtonEvent& event) {
+  bool missed = false;
+  noInterrupts();
+  unsigned long now = millis();
+  bool pressed = digitalRead(pin) == LOW;  // Active LOW
+  if (pressed != lastEdgePressed[button] && now - lastChangeTime[button] >= DEBOUNCE_TIME) {
+    lastEdgePressed[button] = pressed;
+    lastEdgeTime[button] = now;
+    event = {button, (uint8_t)(pressed ? EDGE_PRESS : EDGE_RELEASE), now};
+    missed = true;
+  }
+  interrupts();
+  return missed;
+}
+
+#endif
@@ -0,0 +1,41 @@
+// MediBoxCore: the scheduler, alarm engine, button debouncing, environment checks
+// and display flushing shared by the version1 and version2 firmwares.
+//
+// Header-only, so every option takes effect per firmware: #define it before
+// including this file. Each firmware is a single translation unit and includes
+// the core exactly once. Put this directory under the sketchbook's libraries/
+// (or pass --library to arduino-cli) to build either firmware.
+//
+// Core options
+//   MAX_ALARMS              Alarm table size (default 32)
+//   DEBOUNCE_TIME           Per-button, per-edge debounce, ms (default 50)
+//   MIN_TEMP, MAX_TEMP, MIN_HUMIDITY, MAX_HUMIDITY   Storage limits
+//   SCHEDULER_MAX_WAIT      Longest sleep between scheduler passes, ms (default 2000)
+//   OLED_I2C_CHUNK          Data bytes per I2C transaction when flushing (default 64)
+//
+// Optional firmware modules; code behind a disabled module is not compiled in
+//   MEDIBOX_SERVO           Light/temperature driven shade servo (needs MEDIBOX_LIGHT_TELEMETRY)
+//   MEDIBOX_LIGHT_TELEMETRY LDR acquisition, light averaging and telemetry upload
+
+#ifndef MEDIBOX_CORE_H
+#define MEDIBOX_CORE_H
+
+#ifndef MEDIBOX_SERVO
+#define MEDIBOX_SERVO 0
+#endif
+#ifndef MEDIBOX_LIGHT_TELEMETRY
+#define MEDIBOX_LIGHT_TELEMETRY 0
+#endif
+#if MEDIBOX_SERVO && !MEDIBOX_LIGHT_TELEMETRY
+#error "MEDIBOX_SERVO needs MEDIBOX_LIGHT_TELEMETRY for its light input"
+#endif
+
+#include "MediBoxHal.h"
+#include "MediBoxQueue.h"
+#include "MediBoxScheduler.h"
+#include "MediBoxButtons.h"
+#include "MediBoxAlarms.h"
+#include "MediBoxEnvironment.h"
+#include "MediBoxDisplay.h"
+
+#endif
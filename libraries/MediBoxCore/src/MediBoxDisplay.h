@@ -0,0 +1,70 @@
+// SSD1306 helpers shared by the renderers
+
+#ifndef MEDIBOX_DISPLAY_H
+#define MEDIBOX_DISPLAY_H
+
+#include <Wire.h>
+#include <Adafruit_SSD1306.h>
+#include "MediBoxEnvironment.h"
+
+#ifndef OLED_I2C_CHUNK
+#define OLED_I2C_CHUNK 64  // Data bytes per I2C transaction (Wire buffer is 128)
+#endif
+#define OLED_SHADOW_BYTES (128 * 64 / 8)  // Largest SSD1306 panel
+
+constexpr const char* weekdayNames[7] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+
+// "LOW TEMP! HIGH HUM! ..." for whichever limits are crossed
+void printEnvironmentWarning(Print& out, float temperature, float humidity) {
+  if (temperature < MIN_TEMP) out.print("LOW TEMP! ");
+  if (temperature > MAX_TEMP) out.print("HIGH TEMP! ");
+  if (humidity < MIN_HUMIDITY) out.print("LOW HUM! ");
+  if (humidity > MAX_HUMIDITY) out.print("HIGH HUM! ");
+}
+
+// Copy of what the panel currently shows, used to send only changed columns
+uint8_t panelShadow[OLED_SHADOW_BYTES];
+bool panelShadowValid = false;
+
+// Sends only the column range that changed on each page instead of the full 1 KB frame
+void flushDisplay(Adafruit_SSD1306& panel, uint8_t address) {
+  uint8_t* buffer = panel.getBuffer();
+  int width = panel.width();
+  int pages = panel.height() / 8;
+
+  if (!panelShadowValid) {
+    panel.display();
+    memcpy(panelShadow, buffer, width * pages);
+    panelShadowValid = true;
+    return;
+  }
+
+  for (int page = 0; page < pages; page++) {
+    uint8_t* row = buffer + page * width;
+    uint8_t* shadowRow = panelShadow + page * width;
+
+    int first = 0;
+    while (first < width && row[first] == shadowRow[first]) first++;
+    if (first == width) continue;  // Page unchanged
+    int last = width - 1;
+    while (row[last] == shadowRow[last]) last--;
+
+    panel.ssd1306_command(SSD1306_PAGEADDR);
+    panel.ssd1306_command(page);
+    panel.ssd1306_command(page);
+    panel.ssd1306_command(SSD1306_COLUMNADDR);
+    panel.ssd1306_command(first);
+    panel.ssd1306_command(last);
+
+    for (int col = first; col <= last; col += OLED_I2C_CHUNK) {
+      int count = min(OLED_I2C_CHUNK, last - col + 1);
+      Wire.beginTransmission(address);
+      Wire.write((uint8_t)0x40);  // Co = 0, D/C = 1: data stream
+      Wire.write(row + col, count);
+      Wire.endTransmission();
+    }
+    memcpy(shadowRow + first, row + first, last - first + 1);
+  }
+}
+
+#endif
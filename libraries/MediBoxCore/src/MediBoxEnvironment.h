@@ -0,0 +1,92 @@
+// Storage limits and the checks both firmwares make against them
+
+#ifndef MEDIBOX_ENVIRONMENT_H
+#define MEDIBOX_ENVIRONMENT_H
+
+#include <math.h>
+
+#ifndef MIN_TEMP
+#define MIN_TEMP 24
+#endif
+#ifndef MAX_TEMP
+#define MAX_TEMP 32
+#endif
+#ifndef MIN_HUMIDITY
+#define MIN_HUMIDITY 65
+#endif
+#ifndef MAX_HUMIDITY
+#define MAX_HUMIDITY 80
+#endif
+
+// Adaptive sampling
+// Risk is 0 while every reading is at least the margin inside its limits and
+// changing slower than the rate, and reaches 1 at a limit or at that rate.
+#ifndef ENV_RISK_MARGIN_TEMP
+#define ENV_RISK_MARGIN_TEMP 2.0f        // degC
+#endif
+#ifndef ENV_RISK_MARGIN_HUMIDITY
+#define ENV_RISK_MARGIN_HUMIDITY 5.0f    // %RH
+#endif
+#ifndef ENV_RISK_RATE_TEMP
+#define ENV_RISK_RATE_TEMP 2.0f          // degC per minute
+#endif
+#ifndef ENV_RISK_RATE_HUMIDITY
+#define ENV_RISK_RATE_HUMIDITY 10.0f     // %RH per minute
+#endif
+#define ENV_TREND_WINDOW 60000           // ms; rates over shorter spans are mostly sensor quantisation
+#define ENV_TREND_ALPHA 0.5f             // EWMA weight of each new rate
+
+// Rate of change, measured over at least ENV_TREND_WINDOW
+struct EnvTrend {
+  float temperature;        // Reading at the start of the current window
+  float humidity;
+  unsigned long time;
+  float temperatureRate;    // degC per minute
+  float humidityRate;       // %RH per minute
+  bool valid;
+};
+
+bool environmentOutOfRange(float temperature, float humidity) {
+  return temperature < MIN_TEMP || temperature > MAX_TEMP ||
+         humidity < MIN_HUMIDITY || humidity > MAX_HUMIDITY;
+}
+
+void updateEnvironmentTrend(EnvTrend& trend, float temperature, float humidity, unsigned long now) {
+  if (trend.valid && now - trend.time < ENV_TREND_WINDOW) return;
+  if (trend.valid) {
+    float minutes = (now - trend.time) / 60000.0f;
+    trend.temperatureRate += ENV_TREND_ALPHA * ((temperature - trend.temperature) / minutes - trend.temperatureRate);
+    trend.humidityRate += ENV_TREND_ALPHA * ((humidity - trend.humidity) / minutes - trend.humidityRate);
+  }
+  trend.temperature = temperature;
+  trend.humidity = humidity;
+  trend.time = now;
+  trend.valid = true;
+}
+
+// 0 at least 'margin' inside both limits, 1 at or past either of them
+float limitProximity(float value, float low, float high, float margin) {
+  float inside = fminf(value - low, high - value);
+  if (inside <= 0) return 1;
+  return inside >= margin ? 0 : 1 - inside / margin;
+}
+
+float environmentRisk(float temperature, float humidity, const EnvTrend& trend) {
+  float risk = fmaxf(limitProximity(temperature, MIN_TEMP, MAX_TEMP, ENV_RISK_MARGIN_TEMP),
+                     limitProximity(humidity, MIN_HUMIDITY, MAX_HUMIDITY, ENV_RISK_MARGIN_HUMIDITY));
+  risk = fmaxf(risk, fabsf(trend.temperatureRate) / ENV_RISK_RATE_TEMP);
+  risk = fmaxf(risk, fabsf(trend.humidityRate) / ENV_RISK_RATE_HUMIDITY);
+  return fminf(risk, 1.0f);
+}
+
+// Geometric between slow (risk 0) and fast (risk 1), so each step of risk
+// multiplies the rate by the same factor. Speeds up at once but at most halves
+// the rate per call, so one calm reading after an excursion does not drop straight to slow.
+unsigned long sampleInterval(float risk, unsigned long current, unsigned long fast, unsigned long slow) {
+  unsigned long target = (unsigned long)(fast * powf((float)slow / fast, 1.0f - risk));
+  if (target < fast) target = fast;
+  if (target > slow) target = slow;
+  return current > 0 && target > 2 * current ? 2 * current : target;
+}
+
+#endif
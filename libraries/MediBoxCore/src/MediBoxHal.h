@@ -0,0 +1,34 @@
+// MediBox hardware abstraction layer
+//
+// The application logic reaches the sensors, actuators and clocks only through
+// these calls. Each firmware carries its own implementation (DHT11 and LEDC in
+// version2, DHT22 and plain GPIO in version1) and only needs to define the calls
+// it actually uses; a different build can link its own (simulated clocks,
+// recorded sensor traces) without touching the logic.
+
+#ifndef MEDIBOX_HAL_H
+#define MEDIBOX_HAL_H
+
+#include <stdint.h>
+#include <time.h>
+
+struct HalEnvironment {
+  float temperature;      // degC
+  float humidity;         // %RH
+  const char* error;      // Set when the read failed
+};
+
+// Clocks
+uint32_t halMillis();                            // Monotonic ms, drives the scheduler
+time_t halTime();                                // UTC wall clock in seconds
+void halDelay(uint32_t ms);                      // Idle until the next scheduler deadline
+
+// Sensors
+bool halReadEnvironment(HalEnvironment& reading);  // false on a failed read
+bool halReadLight(int& raw);                       // false if no new conversion is ready
+
+// Actuators
+void halWriteServo(int angle);                   // Degrees, 0-180
+void halWriteSignal(uint8_t pin, uint32_t duty); // LEDC duty at SIGNAL_RESOLUTION, non-zero = on for GPIO
+
+#endif
@@ -0,0 +1,37 @@
+// Lock-free single-producer/single-consumer ring buffer
+
+#ifndef MEDIBOX_QUEUE_H
+#define MEDIBOX_QUEUE_H
+
+#include <stddef.h>
+#include <atomic>
+
+// Holds N - 1 items
+template <typename T, size_t N>
+class SpscQueue {
+public:
+  // Always inlined so ISRs that push stay entirely in IRAM
+  inline __attribute__((always_inline)) bool push(const T& item) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t next = (head + 1) % N;
+    if (next == tail_.load(std::memory_order_acquire)) return false;  // Full
+    items_[head] = item;
+    head_.store(next, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T& item) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) return false;  // Empty
+    item = items_[tail];
+    tail_.store((tail + 1) % N, std::memory_order_release);
+    return true;
+  }
+
+private:
+  T items_[N];
+  std::atomic<size_t> head_{0};
+  std::atomic<size_t> tail_{0};
+};
+
+#endif
@@ -0,0 +1,80 @@
+// Cooperative scheduler
+// Each subsystem runs at its own period; loop() sleeps until the earliest deadline.
+//
+// The firmware defines the table, `Task tasks[] = {...}` with `const int taskCount`,
+// and the two hooks below, which is where low-power suspension and profiling go.
+
+#ifndef MEDIBOX_SCHEDULER_H
+#define MEDIBOX_SCHEDULER_H
+
+#include "MediBoxHal.h"
+
+#ifndef SCHEDULER_MAX_WAIT
+#define SCHEDULER_MAX_WAIT 2000
+#endif
+
+struct Task {
+  const char* name;
+  void (*run)();
+  unsigned long period;   // ms between runs
+  unsigned long nextRun;  // halMillis() deadline of the next run
+  bool enabled;
+  bool idleRun;           // Keeps running (slowed down) while the box is idle in low-power mode
+};
+
+extern Task tasks[];
+extern const int taskCount;
+
+// Supplied by the firmware
+unsigned long taskPeriod(const Task& task);  // Period the task runs at right now; 0 skips it
+void runTask(int id);                        // tasks[id].run(), plus any instrumentation
+
+void startScheduler() {
+  unsigned long now = halMillis();
+  for (int i = 0; i < taskCount; i++) {
+    tasks[i].nextRun = now + tasks[i].period;
+  }
+}
+
+// Runs every due task once and returns the ms until the next deadline
+unsigned long runScheduler() {
+  for (int i = 0; i < taskCount; i++) {
+    unsigned long period = taskPeriod(tasks[i]);
+    if (period == 0) continue;
+    if ((long)(halMillis() - tasks[i].nextRun) >= 0) {
+      runTask(i);
+      period = taskPeriod(tasks[i]);  // The task may have changed its own period
+      if (period == 0) continue;
+      tasks[i].nextRun += period;
+      // Skip missed runs instead of bursting to catch up
+      if ((long)(halMillis() - tasks[i].nextRun) >= 0) {
+        tasks[i].nextRun = halMillis() + period;
+      }
+    }
+  }
+
+  unsigned long now = halMillis();
+  long wait = (long)SCHEDULER_MAX_WAIT;
+  for (int i = 0; i < taskCount; i++) {
+    if (taskPeriod(tasks[i]) == 0) continue;
+    long untilDue = (long)(tasks[i].nextRun - now);
+    if (untilDue < wait) wait = untilDue;
+  }
+  return wait > 0 ? (unsigned long)wait : 0;
+}
+
+// Pulls a task's deadline forward so it runs on the next scheduler pass
+void runTaskNow(int id) {
+  tasks[id].nextRun = halMillis();
+}
+
+// Takes effect immediately: a pending deadline is pulled in if the new period is shorter
+void setTaskPeriod(int id, unsigned long period) {
+  unsigned long next = halMillis() + period;
+  tasks[id].period = period;
+  if ((long)(tasks[id].nextRun - next) > 0) {
+    tasks[id].nextRun = next;
+  }
+}
+
+#endif
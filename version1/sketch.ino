@@ -5,6 +5,11 @@
 #include <WiFiUdp.h>
 #include <DHT.h>
 
+// Core options: the two fixed alarm slots and the original debounce time
+#define MAX_ALARMS 2
+#define DEBOUNCE_TIME 200
+#include <MediBoxCore.h>  // Scheduler, alarm engine, buttons, limits, HAL
+
 // OLED Configuration
 #define OLED_SDA 22
 #define OLED_SCL 21
@@ -26,17 +31,12 @@ Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_ADDR);
 #define DHTTYPE DHT22
 DHT dht(DHTPIN, DHTTYPE);
 
-// Environmental Limits
-#define MIN_TEMP 24
-#define MAX_TEMP 32
-#define MIN_HUMIDITY 65
-#define MAX_HUMIDITY 80
-
 // Timing Constants
-#define DEBOUNCE_TIME 200
-#define ENV_CHECK_INTERVAL 2000
+#define ENV_CHECK_INTERVAL 2000   // Fastest DHT22 rate, used near the limits
+#define ENV_SLOW_INTERVAL 30000   // While readings are stable and mid-range
 #define LED_TOGGLE_INTERVAL 500
 #define SNOOZE_DURATION 120000
+#define CLOCK_STEP_TOLERANCE 2  // Seconds an NTP answer may move the clock before alarms are rescheduled
 
 // NTP Configuration
 #define NTP_SERVER "pool.ntp.org"
@@ -51,25 +51,21 @@ const char* ssid = "Wokwi-GUEST";
 const char* password = "";
 
 // Alarm System
-struct Alarm {
-  int hour;
-  int minute;
-  bool active;
-  bool ringing;
-  bool snoozed;
-  unsigned long snoozeStartTime;
-};
-Alarm alarms[2] = {{0, 0, false, false, false, 0}, {0, 0, false, false, false, 0}};
+// Slot i of the menu is the core alarm with id i + 1; an unset slot has no table entry
+int draftHour = 0;   // Slot being edited from the menu
+int draftMinute = 0;
 
 // System State
 bool alarmTriggered = false;
 bool envWarning = false;
+bool clockValid = false;   // NTP has answered at least once
 int currentAlarmIndex = 0;
+int ringingAlarmId = 0;
 int viewAlarmsSelection = 0;
 float temperature = 0;
 float humidity = 0;
-unsigned long lastEnvCheck = 0;
-unsigned long lastLedToggle = 0;
+EnvTrend envTrend = {};
+bool signalPhase = false;  // Toggles every LED_TOGGLE_INTERVAL for beeping and blinking
 
 // Menu System
 enum AppState { WELCOME, SHOW_TIME, MAIN_MENU, SET_ALARM_HOUR, SET_ALARM_MINUTE, 
@@ -85,22 +81,19 @@ const char* menuItems[] = {
 };
 const int menuItemCount = 4;
 
-// Button interrupt flags
-volatile bool btnUpPressed = false;
-volatile bool btnLeftPressed = false;
-volatile bool btnDownPressed = false;
-volatile bool btnRightPressed = false;
-volatile bool stopAlarmFlag = false;
-volatile bool snoozeAlarmFlag = false;
-unsigned long lastInterruptTime = 0;
+// Button events, timestamped in the ISRs and drained by handleButtons()
+const uint8_t buttonPins[BUTTON_COUNT] = {BTN_UP, BTN_LEFT, BTN_DOWN, BTN_RIGHT};
 
 // Function Declarations
 void IRAM_ATTR handleUpInterrupt();
 void IRAM_ATTR handleLeftInterrupt();
 void IRAM_ATTR handleDownInterrupt();
 void IRAM_ATTR handleRightInterrupt();
+void IRAM_ATTR handleButtonEdge(uint8_t button);
 void connectToWiFi();
+void updateClock();
 void updateTimeZone();
+void rescheduleAllAlarms();
 void displayWelcome();
 void displayTime();
 void displayMenu();
@@ -110,54 +103,58 @@ void displaySetTimezone();
 void displayViewAlarms();
 void displayConfirmDelete();
 void checkEnvironment();
-void handleLED();
+void updateSignals();
 void checkAlarms();
-void handleAlarmTrigger();
 void stopAlarm();
 void snoozeAlarm();
-String getDayOfWeek(int day);
+void beginAlarmSlot(int slot);
+void saveAlarmSlot();
+void deleteAlarmSlot(int slot);
 void handleButtons();
+void handleButtonEvent(const ButtonEvent& event);
 void handleRightButton();
 void handleLeftButton();
 void handleUpButton();
 void handleDownButton();
 void updateDisplay();
 
-// Interrupt Service Routines
-void IRAM_ATTR handleUpInterrupt() { 
-  if (millis() - lastInterruptTime > DEBOUNCE_TIME) { 
-    btnUpPressed = true; 
-    lastInterruptTime = millis(); 
-  } 
-}
+// Cooperative scheduler (MediBoxScheduler.h); loop() sleeps until the earliest deadline
+enum TaskId { TASK_CLOCK, TASK_BUTTONS, TASK_ENVIRONMENT, TASK_ALARMS, TASK_DISPLAY, TASK_SIGNALS,
+  TASK_COUNT };
+
+// Order must match TaskId
+Task tasks[TASK_COUNT] = {
+  {"clock",       updateClock,      1000,                0, true, true},
+  {"buttons",     handleButtons,    10,                  0, true, true},
+  {"environment", checkEnvironment, ENV_CHECK_INTERVAL,  0, true, true},
+  {"alarms",      checkAlarms,      1000,                0, true, true},
+  {"display",     updateDisplay,    100,                 0, true, true},
+  {"signals",     updateSignals,    LED_TOGGLE_INTERVAL, 0, true, true}
+};
+const int taskCount = TASK_COUNT;
 
-void IRAM_ATTR handleLeftInterrupt() { 
-  if (millis() - lastInterruptTime > DEBOUNCE_TIME) { 
-    btnLeftPressed = true; 
-    lastInterruptTime = millis(); 
-  } 
+unsigned long taskPeriod(const Task& task) {
+  return task.enabled ? task.period : 0;
 }
 
-void IRAM_ATTR handleDownInterrupt() { 
-  if (millis() - lastInterruptTime > DEBOUNCE_TIME) { 
-    btnDownPressed = true; 
-    if (currentState == ALARM_TRIGGERED) {
-      snoozeAlarmFlag = true;
-    }
-    lastInterruptTime = millis(); 
-  } 
+void runTask(int id) {
+  tasks[id].run();
 }
 
-void IRAM_ATTR handleRightInterrupt() { 
-  if (millis() - lastInterruptTime > DEBOUNCE_TIME) { 
-    btnRightPressed = true; 
-    if (currentState == ALARM_TRIGGERED) {
-      stopAlarmFlag = true;
-    }
-    lastInterruptTime = millis(); 
-  } 
+// Interrupt Service Routines
+// All four pins trigger on CHANGE; each button debounces on its own
+void IRAM_ATTR handleButtonEdge(uint8_t button) {
+  unsigned long now = millis();
+  bool pressed = digitalRead(buttonPins[button]) == LOW;  // Active LOW
+  if (!debounceButtonEdge(button, pressed, now)) return;
+  buttonEventQueue.push({button, (uint8_t)(pressed ? EDGE_PRESS : EDGE_RELEASE), now});
 }
 
+void IRAM_ATTR handleUpInterrupt() { handleButtonEdge(BUTTON_UP); }
+void IRAM_ATTR handleLeftInterrupt() { handleButtonEdge(BUTTON_LEFT); }
+void IRAM_ATTR handleDownInterrupt() { handleButtonEdge(BUTTON_DOWN); }
+void IRAM_ATTR handleRightInterrupt() { handleButtonEdge(BUTTON_RIGHT); }
+
 void setup() {
   Serial.begin(115200);
   
@@ -176,16 +173,17 @@ void setup() {
   pinMode(BUZZER_PIN, OUTPUT);
   pinMode(LED_PIN, OUTPUT);
   
-  attachInterrupt(digitalPinToInterrupt(BTN_UP), handleUpInterrupt, FALLING);
-  attachInterrupt(digitalPinToInterrupt(BTN_LEFT), handleLeftInterrupt, FALLING);
-  attachInterrupt(digitalPinToInterrupt(BTN_DOWN), handleDownInterrupt, FALLING);
-  attachInterrupt(digitalPinToInterrupt(BTN_RIGHT), handleRightInterrupt, FALLING);
+  attachInterrupt(digitalPinToInterrupt(BTN_UP), handleUpInterrupt, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(BTN_LEFT), handleLeftInterrupt, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(BTN_DOWN), handleDownInterrupt, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(BTN_RIGHT), handleRightInterrupt, CHANGE);
   
   // Initialize DHT sensor
   dht.begin();
   
   // Show welcome message
   displayWelcome();
+  flushDisplay(display, OLED_ADDR);
   delay(2000);
   
   // Connect to WiFi
@@ -197,32 +195,12 @@ void setup() {
   
   // Turn LED on initially
   digitalWrite(LED_PIN, HIGH);
+
+  startScheduler();
 }
 
 void loop() {
-  timeClient.update();
-  handleButtons();
-  checkEnvironment();
-  updateDisplay();
-  checkAlarms();
-  handleLED();
-  
-  if (alarmTriggered) {
-    handleAlarmTrigger();
-  }
-  
-  // Check for immediate alarm actions
-  if (stopAlarmFlag) {
-    stopAlarmFlag = false;
-    stopAlarm();
-  }
-  
-  if (snoozeAlarmFlag) {
-    snoozeAlarmFlag = false;
-    snoozeAlarm();
-  }
-  
-  delay(100);
+  halDelay(runScheduler());
 }
 
 void connectToWiFi() {
@@ -264,8 +242,37 @@ void connectToWiFi() {
 }
 
 
+// NTPClient only contacts the server once its update interval has passed.
+// Most answers only nudge the clock, so alarms are rescheduled on the first
+// sync and on real steps rather than every minute.
+void updateClock() {
+  time_t before = halTime();
+  if (!timeClient.update()) return;
+  bool stepped = !clockValid || labs((long)(halTime() - before)) > CLOCK_STEP_TOLERANCE;
+  clockValid = true;
+  if (stepped) {
+    rescheduleAllAlarms();  // The clock stepped under the table
+  }
+}
+
 void updateTimeZone() {
   timeClient.setTimeOffset(timeZoneOffset);
+
+  // The alarm engine works in UTC and takes local time from the POSIX zone,
+  // whose sign is the opposite of the offset shown on screen
+  char rule[16];
+  int offset = abs(timeZoneOffset);
+  snprintf(rule, sizeof(rule), "UTC%c%02d:%02d", timeZoneOffset >= 0 ? '-' : '+',
+           offset / 3600, (offset % 3600) / 60);
+  setenv("TZ", rule, 1);
+  tzset();
+  rescheduleAllAlarms();  // Alarm times are local
+}
+
+// Needed whenever the clock or time zone changes under the table
+void rescheduleAllAlarms() {
+  if (!clockValid) return;
+  rescheduleAlarms(halTime(), alarmTriggered ? ringingAlarmId : 0);
 }
 
 void displayWelcome() {
@@ -276,39 +283,36 @@ void displayWelcome() {
   display.setTextSize(1);
   display.setCursor(0, 35);
   display.println("Press RIGHT to begin");
-  display.display();
 }
 
 void checkEnvironment() {
-  if (millis() - lastEnvCheck > ENV_CHECK_INTERVAL) {
-    temperature = dht.readTemperature();
-    humidity = dht.readHumidity();
-    lastEnvCheck = millis();
-    
-    // Check if values are within limits
-    envWarning = (temperature < MIN_TEMP || temperature > MAX_TEMP || 
-                 humidity < MIN_HUMIDITY || humidity > MAX_HUMIDITY);
-    
-    // Activate buzzer if limits exceeded (unless alarm is ringing)
-    if (envWarning && !alarmTriggered) {
-      digitalWrite(BUZZER_PIN, HIGH);
-    } else {
-      digitalWrite(BUZZER_PIN, LOW);
-    }
+  HalEnvironment reading;
+  if (!halReadEnvironment(reading)) {
+    Serial.print("DHT read failed: ");
+    Serial.println(reading.error);
+    return;
   }
+  temperature = reading.temperature;
+  humidity = reading.humidity;
+  
+  // Check if values are within limits
+  envWarning = environmentOutOfRange(temperature, humidity);
+
+  // Sample faster as readings approach a limit or change quickly
+  updateEnvironmentTrend(envTrend, temperature, humidity, halMillis());
+  float risk = environmentRisk(temperature, humidity, envTrend);
+  setTaskPeriod(TASK_ENVIRONMENT, sampleInterval(risk, tasks[TASK_ENVIRONMENT].period,
+                                                 ENV_CHECK_INTERVAL, ENV_SLOW_INTERVAL));
 }
 
-void handleLED() {
-  if (envWarning) {
-    // Blink LED if warning
-    if (millis() - lastLedToggle > LED_TOGGLE_INTERVAL) {
-      digitalWrite(LED_PIN, !digitalRead(LED_PIN));
-      lastLedToggle = millis();
-    }
-  } else {
-    // Keep LED on if no warning
-    digitalWrite(LED_PIN, HIGH);
-  }
+// Buzzer beeps (500ms on, 500ms off) while an alarm rings, otherwise sounds if
+// limits are exceeded. LED blinks on a warning and stays on otherwise.
+void updateSignals() {
+  signalPhase = !signalPhase;
+  bool buzzer = alarmTriggered ? signalPhase : envWarning;
+  bool led = envWarning ? signalPhase : true;
+  halWriteSignal(BUZZER_PIN, buzzer);
+  halWriteSignal(LED_PIN, led);
 }
 
 void displayTime() {
@@ -330,7 +334,7 @@ void displayTime() {
   char dateString[30];
   sprintf(dateString, "%02d/%02d/%04d %s", 
          ptm->tm_mday, ptm->tm_mon+1, ptm->tm_year+1900,
-         getDayOfWeek(ptm->tm_wday).c_str());
+         weekdayNames[ptm->tm_wday]);
   display.println(dateString);
   
   // Display environmental data
@@ -347,15 +351,12 @@ void displayTime() {
     
     // Display warning message
     display.setCursor(0, 0);
-    if (temperature < MIN_TEMP) display.print("LOW TEMP! ");
-    if (temperature > MAX_TEMP) display.print("HIGH TEMP! ");
-    if (humidity < MIN_HUMIDITY) display.print("LOW HUM! ");
-    if (humidity > MAX_HUMIDITY) display.print("HIGH HUM! ");
+    printEnvironmentWarning(display, temperature, humidity);
   }
   
   // Display alarm indicators
-  for (int i = 0; i < 2; i++) {
-    if (alarms[i].active) {
+  for (int i = 0; i < MAX_ALARMS; i++) {
+    if (findAlarm(i + 1) >= 0) {
       display.setCursor(110, i * 10);
       display.print("A");
       display.print(i+1);
@@ -364,143 +365,84 @@ void displayTime() {
 }
 
 void checkAlarms() {
-  if (alarmTriggered) return;
-  
-  int currentHour = timeClient.getHours();
-  int currentMinute = timeClient.getMinutes();
-  unsigned long currentMillis = millis();
-  
-  for (int i = 0; i < 2; i++) {
-    // Handle snoozed alarms
-    if (alarms[i].snoozed) {
-      if (currentMillis - alarms[i].snoozeStartTime >= SNOOZE_DURATION) {
-        alarms[i].snoozed = false;
-        // Reactivate the alarm for the next minute
-        alarms[i].hour = currentHour;
-        alarms[i].minute = currentMinute;
-      } else {
-        continue; // Skip if still in snooze period
-      }
-    }
-    
-    if (alarms[i].active && !alarms[i].ringing &&
-        alarms[i].hour == currentHour && 
-        alarms[i].minute == currentMinute) {
-      alarms[i].ringing = true;
-      alarmTriggered = true;
-      currentState = ALARM_TRIGGERED;
-    }
-  }
-}
-
-void handleAlarmTrigger() {
-  static unsigned long lastBeep = 0;
-  static bool buzzerState = false;
-  
-  // Override environmental warning buzzer
-  digitalWrite(BUZZER_PIN, LOW);
-  
-  // Buzzer beeping (500ms on, 500ms off)
-  if (millis() - lastBeep > 500) {
-    buzzerState = !buzzerState;
-    digitalWrite(BUZZER_PIN, buzzerState ? HIGH : LOW);
-    lastBeep = millis();
-  }
-  
-  // Display alarm message with current time
-  display.clearDisplay();
-  
-  // Show current time at top
-  display.setTextSize(1);
-  display.setCursor(0, 0);
-  String formattedTime = timeClient.getFormattedTime();
-  display.println(formattedTime);
+  if (alarmTriggered || !clockValid) return;
   
-  // Show environmental data
-  display.setCursor(70, 0);
-  display.print(temperature, 1);
-  display.print("C ");
-  display.print(humidity, 0);
-  display.print("%");
-  
-  // Show alarm message
-  display.setTextSize(2);
-  display.setCursor(0, 15);
-  
-  // Find which alarm is triggered
-  for (int i = 0; i < 2; i++) {
-    if (alarms[i].ringing) {
-      display.print("ALARM ");
-      display.println(i+1);
-      currentAlarmIndex = i;
-      break;
-    }
+  int missedId;
+  int index = dueAlarm(halTime(), missedId);
+  if (missedId) {
+    Serial.print("Missed alarm ");
+    Serial.println(missedId);
   }
-  
-  display.setTextSize(1);
-  display.setCursor(0, 35);
-  display.println("RIGHT: Stop Alarm");
-  display.setCursor(0, 45);
-  display.println("DOWN: Snooze (2min)");
-  
-  display.display();
+  if (index < 0) return;
+  alarmTriggered = true;
+  ringingAlarmId = alarms[index].id;
+  currentState = ALARM_TRIGGERED;
 }
 
 void stopAlarm() {
-  digitalWrite(BUZZER_PIN, LOW);
+  halWriteSignal(BUZZER_PIN, LOW);
   alarmTriggered = false;
   
-  // Turn off all ringing alarms
-  for (int i = 0; i < 2; i++) {
-    alarms[i].ringing = false;
-    alarms[i].snoozed = false;
-  }
+  // Back onto tomorrow's schedule
+  int index = findAlarm(ringingAlarmId);
+  if (index >= 0) rearmAlarm(index, halTime());
+  ringingAlarmId = 0;
   
   currentState = SHOW_TIME;
 }
 
 void snoozeAlarm() {
-  digitalWrite(BUZZER_PIN, LOW);
+  halWriteSignal(BUZZER_PIN, LOW);
   alarmTriggered = false;
   
-  // Set snooze state
-  alarms[currentAlarmIndex].ringing = false;
-  alarms[currentAlarmIndex].snoozed = true;
-  alarms[currentAlarmIndex].snoozeStartTime = millis();
+  // Ring again after the snooze period without touching the alarm's time
+  int index = findAlarm(ringingAlarmId);
+  if (index >= 0) snoozeAlarmUntil(index, halTime() + SNOOZE_DURATION / 1000);
+  ringingAlarmId = 0;
   
   currentState = SHOW_TIME;
 }
 
-String getDayOfWeek(int day) {
-  switch(day) {
-    case 0: return "Sun";
-    case 1: return "Mon";
-    case 2: return "Tue";
-    case 3: return "Wed";
-    case 4: return "Thu";
-    case 5: return "Fri";
-    case 6: return "Sat";
-    default: return "";
-  }
+// Starts editing a slot from its current time, or 00:00 if unset
+void beginAlarmSlot(int slot) {
+  currentAlarmIndex = slot;
+  int index = findAlarm(slot + 1);
+  draftHour = index >= 0 ? alarms[index].hour : 0;
+  draftMinute = index >= 0 ? alarms[index].minute : 0;
+  currentState = SET_ALARM_HOUR;
+}
+
+void saveAlarmSlot() {
+  deleteAlarmSlot(currentAlarmIndex);
+  insertAlarm(currentAlarmIndex + 1, draftHour, draftMinute, ALARM_EVERY_DAY, halTime());
+}
+
+void deleteAlarmSlot(int slot) {
+  int index = findAlarm(slot + 1);
+  if (index >= 0) removeAlarm(index);
 }
 
 void handleButtons() {
-  if (btnRightPressed) {
-    btnRightPressed = false;
-    handleRightButton();
-  }
-  if (btnLeftPressed) {
-    btnLeftPressed = false;
-    handleLeftButton();
+  ButtonEvent event;
+  while (buttonEventQueue.pop(event)) {
+    handleButtonEvent(event);
   }
-  if (btnUpPressed) {
-    btnUpPressed = false;
-    handleUpButton();
+
+  // Edges dropped inside the debounce window turn up once the pin settles
+  for (uint8_t button = 0; button < BUTTON_COUNT; button++) {
+    if (settleButton(button, buttonPins[button], event)) handleButtonEvent(event);
   }
-  if (btnDownPressed) {
-    btnDownPressed = false;
-    handleDownButton();
+}
+
+void handleButtonEvent(const ButtonEvent& event) {
+  if (event.edge != EDGE_PRESS) return;
+  switch (event.button) {
+    case BUTTON_RIGHT: handleRightButton(); break;
+    case BUTTON_LEFT:  handleLeftButton(); break;
+    case BUTTON_UP:    handleUpButton(); break;
+    case BUTTON_DOWN:  handleDownButton(); break;
   }
+  runTaskNow(TASK_DISPLAY);
 }
 
 void handleRightButton() {
@@ -514,11 +456,9 @@ void handleRightButton() {
       break;
     case MAIN_MENU:
       if (menuOption == 0) {
-        currentAlarmIndex = 0;
-        currentState = SET_ALARM_HOUR;
+        beginAlarmSlot(0);
       } else if (menuOption == 1) {
-        currentAlarmIndex = 1;
-        currentState = SET_ALARM_HOUR;
+        beginAlarmSlot(1);
       } else if (menuOption == 2) {
         currentState = SET_TIMEZONE;
       } else if (menuOption == 3) {
@@ -530,21 +470,19 @@ void handleRightButton() {
       currentState = SET_ALARM_MINUTE;
       break;
     case SET_ALARM_MINUTE:
-      alarms[currentAlarmIndex].active = true;
+      saveAlarmSlot();
       currentState = MAIN_MENU;
       break;
     case SET_TIMEZONE:
       currentState = MAIN_MENU;
       break;
     case VIEW_ALARMS:
-      if (alarms[viewAlarmsSelection].active) {
+      if (findAlarm(viewAlarmsSelection + 1) >= 0) {
         currentState = CONFIRM_DELETE;
       }
       break;
     case CONFIRM_DELETE:
-      alarms[viewAlarmsSelection].active = false;
-      alarms[viewAlarmsSelection].ringing = false;
-      alarms[viewAlarmsSelection].snoozed = false;
+      deleteAlarmSlot(viewAlarmsSelection);
       currentState = VIEW_ALARMS;
       break;
     case ALARM_TRIGGERED:
@@ -568,10 +506,10 @@ void handleLeftButton() {
 void handleUpButton() {
   switch(currentState) {
     case SET_ALARM_HOUR:
-      alarms[currentAlarmIndex].hour = (alarms[currentAlarmIndex].hour + 1) % 24;
+      draftHour = (draftHour + 1) % 24;
       break;
     case SET_ALARM_MINUTE:
-      alarms[currentAlarmIndex].minute = (alarms[currentAlarmIndex].minute + 1) % 60;
+      draftMinute = (draftMinute + 1) % 60;
       break;
     case SET_TIMEZONE:
       timeZoneOffset += 1800; // 30 minutes
@@ -582,12 +520,10 @@ void handleUpButton() {
       menuOption = (menuOption - 1 + menuItemCount) % menuItemCount;
       break;
     case VIEW_ALARMS:
-      viewAlarmsSelection = (viewAlarmsSelection - 1 + 2) % 2;
+      viewAlarmsSelection = (viewAlarmsSelection - 1 + MAX_ALARMS) % MAX_ALARMS;
       break;
     case CONFIRM_DELETE:
-      alarms[viewAlarmsSelection].active = false;
-      alarms[viewAlarmsSelection].ringing = false;
-      alarms[viewAlarmsSelection].snoozed = false;
+      deleteAlarmSlot(viewAlarmsSelection);
       currentState = VIEW_ALARMS;
       break;
   }
@@ -596,10 +532,10 @@ void handleUpButton() {
 void handleDownButton() {
   switch(currentState) {
     case SET_ALARM_HOUR:
-      alarms[currentAlarmIndex].hour = (alarms[currentAlarmIndex].hour - 1 + 24) % 24;
+      draftHour = (draftHour - 1 + 24) % 24;
       break;
     case SET_ALARM_MINUTE:
-      alarms[currentAlarmIndex].minute = (alarms[currentAlarmIndex].minute - 1 + 60) % 60;
+      draftMinute = (draftMinute - 1 + 60) % 60;
       break;
     case SET_TIMEZONE:
       timeZoneOffset -= 1800; // 30 minutes
@@ -610,11 +546,14 @@ void handleDownButton() {
       menuOption = (menuOption + 1) % menuItemCount;
       break;
     case VIEW_ALARMS:
-      viewAlarmsSelection = (viewAlarmsSelection + 1) % 2;
+      viewAlarmsSelection = (viewAlarmsSelection + 1) % MAX_ALARMS;
       break;
     case CONFIRM_DELETE:
       currentState = VIEW_ALARMS;
       break;
+    case ALARM_TRIGGERED:
+      snoozeAlarm();
+      break;
   }
 }
 
@@ -642,15 +581,8 @@ void updateDisplay() {
     display.setTextSize(2);
     display.setCursor(0, 15);
     
-    // Find which alarm is triggered
-    for (int i = 0; i < 2; i++) {
-      if (alarms[i].ringing) {
-        display.print("ALARM ");
-        display.println(i+1);
-        currentAlarmIndex = i;
-        break;
-      }
-    }
+    display.print("ALARM ");
+    display.println(ringingAlarmId);
     
     display.setTextSize(1);
     display.setCursor(0, 35);
@@ -658,7 +590,7 @@ void updateDisplay() {
     display.setCursor(0, 45);
     display.println("DOWN: Snooze (2min)");
     
-    display.display();
+    flushDisplay(display, OLED_ADDR);
     return;
   }
 
@@ -690,7 +622,7 @@ void updateDisplay() {
       break;
   }
   
-  display.display();
+  flushDisplay(display, OLED_ADDR);
 }
 
 void displayMenu() {
@@ -725,8 +657,8 @@ void displaySetAlarmHour() {
   
   display.setTextSize(2);
   display.setCursor(40, 25);
-  if (alarms[currentAlarmIndex].hour < 10) display.print("0");
-  display.print(alarms[currentAlarmIndex].hour);
+  if (draftHour < 10) display.print("0");
+  display.print(draftHour);
   
   display.setTextSize(1);
   display.setCursor(0, 55);
@@ -743,8 +675,8 @@ void displaySetAlarmMinute() {
   
   display.setTextSize(2);
   display.setCursor(40, 25);
-  if (alarms[currentAlarmIndex].minute < 10) display.print("0");
-  display.print(alarms[currentAlarmIndex].minute);
+  if (draftMinute < 10) display.print("0");
+  display.print(draftMinute);
   
   display.setTextSize(1);
   display.setCursor(0, 55);
@@ -790,7 +722,7 @@ void displayViewAlarms() {
   display.setCursor(0, 0);
   display.println("Active Alarms:");
   
-  for (int i = 0; i < 2; i++) {
+  for (int i = 0; i < MAX_ALARMS; i++) {
     display.setCursor(5, 15 + (i * 15));
     if (i == viewAlarmsSelection) display.print("> ");
     else display.print("  ");
@@ -798,12 +730,13 @@ void displayViewAlarms() {
     display.print("Alarm ");
     display.print(i+1);
     display.print(": ");
-    if (alarms[i].active) {
-      if (alarms[i].hour < 10) display.print("0");
-      display.print(alarms[i].hour);
+    int index = findAlarm(i + 1);
+    if (index >= 0) {
+      if (alarms[index].hour < 10) display.print("0");
+      display.print(alarms[index].hour);
       display.print(":");
-      if (alarms[i].minute < 10) display.print("0");
-      display.print(alarms[i].minute);
+      if (alarms[index].minute < 10) display.print("0");
+      display.print(alarms[index].minute);
     } else {
       display.print("Not set");
     }
@@ -811,7 +744,7 @@ void displayViewAlarms() {
   
   // Display instructions
   display.setCursor(0, 55);
-  if (alarms[viewAlarmsSelection].active) {
+  if (findAlarm(viewAlarmsSelection + 1) >= 0) {
     display.println("LEFT:Exit RIGHT:Delete");
   } else {
     display.println("LEFT:Exit");
@@ -819,6 +752,9 @@ void displayViewAlarms() {
 }
 
 void displayConfirmDelete() {
+  int index = findAlarm(viewAlarmsSelection + 1);
+  if (index < 0) return;  // Deleted while the prompt was up
+
   display.clearDisplay();
   display.setTextSize(1);
   display.setCursor(0, 0);
@@ -827,13 +763,42 @@ void displayConfirmDelete() {
   display.println("?");
   
   display.setCursor(0, 20);
-  display.print(alarms[viewAlarmsSelection].hour < 10 ? "0" : "");
-  display.print(alarms[viewAlarmsSelection].hour);
+  display.print(alarms[index].hour < 10 ? "0" : "");
+  display.print(alarms[index].hour);
   display.print(":");
-  display.print(alarms[viewAlarmsSelection].minute < 10 ? "0" : "");
-  display.println(alarms[viewAlarmsSelection].minute);
+  display.print(alarms[index].minute < 10 ? "0" : "");
+  display.println(alarms[index].minute);
   
   display.setTextSize(1);
   display.setCursor(0, 40);
   display.println("UP: Yes, DOWN: No");
-}
\ No newline at end of file
+}
+
+// ESP32 implementation of MediBoxHal.h
+uint32_t halMillis() {
+  return millis();
+}
+
+// NTPClient's epoch has the zone offset folded in
+time_t halTime() {
+  return timeClient.getEpochTime() - timeZoneOffset;
+}
+
+void halDelay(uint32_t ms) {
+  delay(ms);
+}
+
+bool halReadEnvironment(HalEnvironment& reading) {
+  reading.temperature = dht.readTemperature();
+  reading.humidity = dht.readHumidity();
+  reading.error = NULL;
+  if (isnan(reading.temperature) || isnan(reading.humidity)) {
+    reading.error = "no response";
+  }
+  return reading.error == NULL;
+}
+
+// Buzzer and LED are plain GPIO on this board
+void halWriteSignal(uint8_t pin, uint32_t duty) {
+  digitalWrite(pin, duty ? HIGH : LOW);
+}
@@ -1,21 +1,38 @@
+// Optional core modules (see MediBoxCore.h)
+#define MEDIBOX_SERVO 1
+#define MEDIBOX_LIGHT_TELEMETRY 1
+
 #include <WiFi.h>
 #include <PubSubClient.h>
+#if MEDIBOX_SERVO
 #include <ESP32Servo.h>  // For ESP32 servo control
+#endif
 #include <DHTesp.h>      // For DHT11
 #include <Wire.h>
 #include <Adafruit_SSD1306.h>
-#include <NTPClient.h>
-#include <WiFiUdp.h>
+#include <time.h>
+#include <esp_sntp.h>
+#include <Preferences.h>
+#include <LittleFS.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
+#include <MediBoxCore.h>  // Scheduler, alarm engine, buttons, limits, HAL
+
+// Build mode: 1 pins networking to core 0, sensing and UI stay on core 1
+#define DUAL_CORE_MODE 0
+#define NETWORK_CORE 0
+#define NETWORK_TASK_STACK 8192
 
 #define DHT_PIN 23
-#define LDR_PIN 33              //
+#define LDR_PIN 33              // ADC1 channel, required for continuous mode
+#define LDR_CONTINUOUS_ADC 0    // 1: oversample the LDR in the background with the continuous (DMA) ADC driver
+#define LDR_OVERSAMPLE 64       // Conversions averaged per reading in continuous mode
+#define LDR_ADC_FREQUENCY 20000 // Continuous mode conversion rate (Hz)
+#define LDR_ACQUIRE_INTERVAL 100
+#define LDR_FILTER_ALPHA 0.2f   // EWMA weight of each new reading
 #define SERVO_PIN 13  
-
-// Environmental parameter Limits
-#define MIN_TEMP 24
-#define MAX_TEMP 32
-#define MIN_HUMIDITY 65
-#define MAX_HUMIDITY 80
+#define SERVO_DEADBAND 1.0f     // Degrees the target must move before the servo is written
+#define SERVO_SLEW_RATE 30.0f   // Max degrees per second
 
 // OLED Configuration
 #define OLED_SDA 22
@@ -23,6 +40,7 @@
 #define SCREEN_WIDTH 128
 #define SCREEN_HEIGHT 64
 #define OLED_ADDR 0x3C
+#define OLED_PAGES (SCREEN_HEIGHT / 8)
 Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_ADDR);
 
 #define BTN_UP 34
@@ -32,74 +50,319 @@ Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_ADDR);
 #define BUZZER_PIN 2
 #define LED_PIN 18
 
+// Signalling
+// Buzzer and LED are driven by LEDC at 1 Hz, so a 50% duty gives the 500 ms on /
+// 500 ms off cadence in hardware and the loop only writes a duty when the pattern changes.
+// 1 Hz needs the 20-bit timer resolution to stay inside the LEDC clock divider range.
+#define SIGNAL_FREQUENCY 1
+#define SIGNAL_RESOLUTION 20
+#define SIGNAL_DUTY_FULL (1UL << SIGNAL_RESOLUTION)
+
 // Timing Constants
-#define DEBOUNCE_TIME 200
-#define ENV_CHECK_INTERVAL 2000
-#define LED_TOGGLE_INTERVAL 500
+#define LONG_PRESS_TIME 600     // Hold time before auto-repeat starts
+#define REPEAT_INTERVAL 120     // Auto-repeat period while held
+#define ENV_CHECK_INTERVAL 2000  // Also the longest the scheduler sleeps (SCHEDULER_MAX_WAIT)
 #define SNOOZE_DURATION 120000
 
+// Adaptive sampling: the DHT and the light sampler slow down while readings are
+// stable and mid-range, and speed back up as a reading nears a limit or moves
+// quickly (environmentRisk() in MediBoxEnvironment.h). ENV_CHECK_INTERVAL and
+// samplingInterval become the fastest rates.
+#define ADAPTIVE_SAMPLING 1
+#define ENV_SLOW_INTERVAL 30000
+#define LIGHT_SLOW_FACTOR 6          // Calm light sampling runs at samplingInterval x this
+#define EXCURSION_BURST_SAMPLES 10   // Readings published one by one when an excursion starts
+
 // WiFi Configuration
 const char* ssid = "Wokwi-GUEST";
 const char* password = "";
 
-// NTP Configuration
+// Connection manager timing
+#define WIFI_CONNECT_TIMEOUT 10000   // Full scan + DHCP
+#define WIFI_FAST_CONNECT_TIMEOUT 3000  // Cached BSSID/channel, then DHCP
+#define NET_BACKOFF_MIN 1000
+#define NET_BACKOFF_MAX 60000
+// In single-core mode each broker connect attempt runs inside loop(): the DNS
+// lookup (cached by lwIP after the first), TCP connect and MQTT handshake hold up
+// the UI, buttons and alarm servicing for up to MQTT_CONNECT_TIMEOUT plus
+// MQTT_SOCKET_TIMEOUT, so both are kept short there. DUAL_CORE_MODE moves the
+// whole attempt to the network core and can afford to wait longer.
+#if DUAL_CORE_MODE
+#define MQTT_CONNECT_TIMEOUT 3000    // ms for the TCP connect
+#define MQTT_SOCKET_TIMEOUT 2        // Seconds PubSubClient waits on the broker
+#else
+#define MQTT_CONNECT_TIMEOUT 500
+#define MQTT_SOCKET_TIMEOUT 1
+#endif
+
+// Fast boot: sensing, alarms and the display come up first with no splash delay,
+// and the network connects in the background. 0 restores the blocking boot.
+#define FAST_BOOT 1
+unsigned long bootPhaseStart = 0;
+
+// Low-power mode: Wi-Fi modem sleep, display blanking after inactivity, and light
+// sleep between scheduled tasks whenever nothing needs the loop (no alert, screen off,
+// network backing off).
+// While idle, the display and alarm-control tasks are suspended and the rest run at
+// most every IDLE_MIN_PERIOD; a button press wakes the CPU and the screen.
+#define LOW_POWER_MODE 0
+#define DISPLAY_TIMEOUT 30000
+#define IDLE_MIN_PERIOD 1000
+#define LIGHT_SLEEP_MIN 20           // ms; shorter waits are not worth the wake-up cost
+#define POWER_REPORT_INTERVAL 60000
+#define ACTIVE_CURRENT_MA 30.0f      // Datasheet figures for the ESP32 module only
+#define LIGHT_SLEEP_CURRENT_MA 0.8f  // (modem sleep, 80-240 MHz / light sleep)
+
+// Profiling: cycle-counter timing of every scheduler task, published on
+// medibox/<id>/diag. Compiled out entirely when 0.
+#define ENABLE_PROFILING 0
+#define PROFILE_BUCKETS 20            // log2(us) histogram, last bucket is ~0.5 s and up
+#define PROFILE_REPORT_INTERVAL 60000
+#define PROFILE_PUBLISH_INTERVAL 200  // One task per message so the outbound queue never fills
+#define LOOP_BUDGET_US 10000          // A scheduler pass longer than the fastest task period
+
+// Trace: TRACE_RECORD logs every DHT reading, LDR sample, button edge and config
+// message to LittleFS with its timestamp. TRACE_REPLAY feeds such a trace back
+// through the same code on a virtual clock, as fast as the loop can run, with the
+// network left down; combine with ENABLE_PROFILING to compare loop-time profiles.
+#define TRACE_OFF 0
+#define TRACE_RECORD 1
+#define TRACE_REPLAY 2
+#define TRACE_MODE TRACE_OFF
+#define TRACE_PATH "/trace.bin"
+#define TRACE_PREVIOUS_PATH "/trace.prev.bin"  // Last boot's trace survives a crash-reset
+#define TRACE_MAX_BYTES 524288                 // ~1.5 h at the default sampling periods
+#define TRACE_FLUSH_INTERVAL 5000
+
+// Heap check: the clock and display paths must not allocate. Each clock or display
+// run that leaves less free heap than it found is reported, and free heap is compared
+// against a baseline taken once the network and store have done their one-off setup.
+// Other cores allocating at the same instant can show up too, so these are warnings.
+#define HEAP_CHECK 1
+#define HEAP_CHECK_INTERVAL 60000
+#define HEAP_DRIFT_LIMIT 2048        // Bytes below the baseline before drift is reported
+
+#if HEAP_CHECK
+uint32_t heapBaseline = 0;           // 0 until the first check
+uint32_t heapAllocatingRuns = 0;     // Clock/display runs that allocated
+#endif
+
+#if LOW_POWER_MODE
+bool powerIdle = false;
+bool displayBlanked = false;
+unsigned long lastUserActivity = 0;
+bool wakeFilter = false;             // Screen just woke: presses queued before wokenAt are stale
+unsigned long wokenAt = 0;
+unsigned long powerWindowStart = 0;  // halMillis() the current report window began
+unsigned long sleepTimeInWindow = 0; // ms spent in light sleep since then
+#endif
+
+// Clock
+// The IDF SNTP service disciplines the system clock in the background, and the
+// RTC keeps it running through network loss (and soft resets).
 #define NTP_SERVER "pool.ntp.org"
-WiFiUDP ntpUDP;
-NTPClient timeClient(ntpUDP, NTP_SERVER, 0, 60000);
-// Timezone
-int timeZoneOffset = 19800; // Default: Sri Lanka (UTC+5:30)
+#define NTP_SYNC_INTERVAL 3600000   // ms between SNTP polls
+#define MIN_VALID_EPOCH 1700000000  // Anything earlier means the clock was never set
+
+// Broken-down local time and its text, refreshed only when the second changes
+struct ClockCache {
+  time_t epoch;     // UTC
+  struct tm local;
+  bool valid;
+  char time[9];     // "HH:MM:SS"
+  char date[40];    // "DD/MM/YYYY Ddd", sized for any int in each field
+};
+ClockCache clockCache = {};
+volatile bool clockSynced = false;  // Set from the SNTP callback
+
+// Time zones as POSIX TZ rules, so DST is handled by the C library
+struct TimeZone {
+  const char* name;
+  const char* rule;
+};
+
+const TimeZone timeZones[] = {
+  {"UTC",         "UTC0"},
+  {"London",      "GMT0BST,M3.5.0/1,M10.5.0"},
+  {"Berlin",      "CET-1CEST,M3.5.0,M10.5.0/3"},
+  {"Cairo",       "EET-2EEST,M4.5.5/0,M10.5.4/24"},
+  {"Dubai",       "<+04>-4"},
+  {"Karachi",     "PKT-5"},
+  {"Colombo",     "<+0530>-5:30"},
+  {"Kolkata",     "IST-5:30"},
+  {"Kathmandu",   "<+0545>-5:45"},
+  {"Dhaka",       "<+06>-6"},
+  {"Bangkok",     "<+07>-7"},
+  {"Singapore",   "<+08>-8"},
+  {"Tokyo",       "JST-9"},
+  {"Sydney",      "AEST-10AEDT,M10.1.0,M4.1.0/3"},
+  {"Auckland",    "NZST-12NZDT,M9.5.0,M4.1.0/3"},
+  {"Sao Paulo",   "<-03>3"},
+  {"New York",    "EST5EDT,M3.2.0,M11.1.0"},
+  {"Chicago",     "CST6CDT,M3.2.0,M11.1.0"},
+  {"Denver",      "MST7MDT,M3.2.0,M11.1.0"},
+  {"Los Angeles", "PST8PDT,M3.2.0,M11.1.0"}
+};
+const int timeZoneCount = sizeof(timeZones) / sizeof(timeZones[0]);
+int timeZoneIndex = 6;  // Default: Sri Lanka (UTC+5:30)
 
 WiFiClient myWifiClient;
 PubSubClient mqttClient(myWifiClient);  
 
-struct Alarm {
-  int hour;
-  int minute;
-  bool active;
-  bool ringing;
-  bool snoozed;
-  unsigned long snoozeStartTime;
+// Non-volatile storage. A Preferences object holds one open handle and is not
+// thread-safe, so the Wi-Fi cache (network core in DUAL_CORE_MODE) and the
+// settings (loop core) each get their own; NVS itself serialises the writes.
+Preferences prefs;
+Preferences wifiPrefs;
+#define PREFS_NAMESPACE "medibox"
+
+// Network connection state machine, driven by serviceNetwork()
+enum NetState { NET_WIFI_START, NET_WIFI_CONNECTING, NET_WIFI_BACKOFF,
+  NET_MQTT_CONNECT, NET_MQTT_BACKOFF, NET_ONLINE };
+NetState netState = NET_WIFI_START;
+unsigned long netStateSince = 0;
+unsigned long netBackoff = NET_BACKOFF_MIN;
+unsigned long netJitter = 0;  // Random extra wait so a fleet does not reconnect in lockstep
+
+// Last good access point, kept in NVS so reconnects and cold boots skip the scan.
+// The address always comes from DHCP: a cached lease would expire or be handed out again.
+#define WIFI_CACHE_MAGIC 0x57494632
+struct WifiCache {
+  uint32_t magic;
+  uint8_t bssid[6];
+  int32_t channel;
 };
-Alarm alarms[2] = {{0, 0, false, false, false, 0}, {0, 0, false, false, false, 0}};
+WifiCache wifiCache = {};
+bool wifiFastConnect = false;  // Current attempt is using the cache
+
+// Alarm list (the table itself is in MediBoxAlarms.h)
+#define VIEW_ALARM_ROWS 3
 
 // System State
 bool alarmTriggered = false;
 bool envWarning = false;
-int currentAlarmIndex = 0;
+int ringingAlarmId = 0;
 int viewAlarmsSelection = 0;
-float temperature = 0;
-float humidity = 0;
-unsigned long lastEnvCheck = 0;
-unsigned long lastLedToggle = 0;
+int viewAlarmsScroll = 0;          // First row shown in the list
+int deleteAlarmId = 0;
+int draftHour = 0;                 // Alarm being entered from the menu
+int draftMinute = 0;
+
+// Persistent settings
+// One versioned, CRC-checked blob in NVS. Edits only mark it dirty; it is written
+// once things have been quiet for SETTINGS_SAVE_DELAY, and only if it changed.
+#define SETTINGS_MAGIC 0x4D424F58   // "MBOX"
+#define SETTINGS_VERSION 2
+#define SETTINGS_SAVE_DELAY 5000
+
+struct StoredAlarm {
+  uint8_t id;
+  uint8_t hour;
+  uint8_t minute;
+  uint8_t days;
+};
+
+struct Settings {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t alarmCount;
+  int32_t timeZoneIndex;
+  float thetaOffset;
+  float tMed;
+  float controlFactor;
+  uint32_t samplingInterval;
+  uint32_t sendingInterval;
+  StoredAlarm alarms[MAX_ALARMS];
+  uint32_t crc;                     // CRC-32 of everything above
+};
+Settings savedSettings = {};         // Last blob written or loaded
+bool settingsDirty = false;
+unsigned long settingsDirtySince = 0;
+
+enum SignalPattern { SIGNAL_OFF, SIGNAL_BLINK, SIGNAL_SOLID };
+SignalPattern buzzerPattern = SIGNAL_OFF;  // What each pin is currently driving
+SignalPattern ledPattern = SIGNAL_OFF;
+
+// Latest DHT reading, shared by the display, warning logic and servo
+struct EnvSnapshot {
+  float temperature;
+  float humidity;
+  unsigned long timestamp;  // millis() of the reading
+  bool valid;               // At least one good reading so far
+};
+EnvSnapshot envSnapshot = {0, 0, 0, false};
+
+#if ADAPTIVE_SAMPLING
+EnvTrend envTrend = {};
+unsigned long envFastInterval = ENV_CHECK_INTERVAL;  // Raised to the DHT's minimum period in setup()
+int burstSamplesLeft = 0;
+#endif
 
 // Menu System
+// Transitions and renderers live in the screens[] table next to dispatchButton()
 enum AppState { WELCOME, SHOW_TIME, MAIN_MENU, SET_ALARM_HOUR, SET_ALARM_MINUTE, 
-  SET_TIMEZONE, VIEW_ALARMS, ALARM_TRIGGERED, CONFIRM_DELETE };
+  SET_TIMEZONE, VIEW_ALARMS, ALARM_TRIGGERED, CONFIRM_DELETE, STATE_COUNT };
+#define STAY STATE_COUNT  // Transition target that keeps the current state
 AppState currentState = WELCOME;
 int menuOption = 0;
 
-const char* menuItems[] = {
-"Set Alarm 1",
-"Set Alarm 2",
-"Set Timezone",
-"View Alarms"
+// Render pipeline
+// Everything a screen depends on, compared against the last frame to skip redraws
+struct ScreenInputs {
+  int state;
+  int menuOption;
+  int ringingAlarmId;
+  int viewSelection;
+  int viewScroll;
+  int deleteAlarmId;
+  int draftHour;
+  int draftMinute;
+  unsigned long alarmRevision;
+  int timeZoneIndex;
+  unsigned long epoch;    // Only tracked on screens that show the clock
+  int temperatureTenths;
+  int humidityPercent;
+  bool envWarning;
+};
+ScreenInputs lastScreenInputs;
+bool redrawRequested = true;
+
+// Alarm screen static text, rendered once per ringing alarm
+uint8_t alarmScreenTemplate[SCREEN_WIDTH * OLED_PAGES];
+int alarmTemplateId = -1;
+
+// Button events are timestamped in the ISRs and drained by handleButtons()
+const uint8_t buttonPins[BUTTON_COUNT] = {BTN_UP, BTN_LEFT, BTN_DOWN, BTN_RIGHT};
+
+// Hold tracking, owned by handleButtons()
+struct ButtonState {
+  bool held;
+  unsigned long pressedAt;
+  unsigned long lastRepeat;
+};
+ButtonState buttonStates[BUTTON_COUNT] = {};
+
+// Alarm control events, pushed straight from the RIGHT/DOWN ISRs while ringing
+enum AlarmAction { ALARM_ACTION_STOP, ALARM_ACTION_SNOOZE };
+struct AlarmEvent {
+  AlarmAction action;
+  unsigned long pressedAt;  // micros() at the button edge
 };
-const int menuItemCount = 4;
+SpscQueue<AlarmEvent, 8> alarmEventQueue;
 
-// Button interrupt flags
-volatile bool btnUpPressed = false;
-volatile bool btnLeftPressed = false;
-volatile bool btnDownPressed = false;
-volatile bool btnRightPressed = false;
-volatile bool stopAlarmFlag = false;
-volatile bool snoozeAlarmFlag = false;
-unsigned long lastInterruptTime = 0;
+// Press-to-silence latency (us)
+unsigned long lastSilenceLatency = 0;
+unsigned long worstSilenceLatency = 0;
 
 // Function Declarations
+struct TelemetryFrame;
 void IRAM_ATTR handleUpInterrupt();
 void IRAM_ATTR handleLeftInterrupt();
 void IRAM_ATTR handleDownInterrupt();
 void IRAM_ATTR handleRightInterrupt();
+void IRAM_ATTR handleButtonEdge(uint8_t button);
+void dispatchButton(uint8_t button);
+bool isRepeatState();
 void updateTimeZone();
 void displayWelcome();
 void displayTime();
@@ -109,747 +372,2544 @@ void displaySetAlarmMinute();
 void displaySetTimezone();
 void displayViewAlarms();
 void displayConfirmDelete();
+void displayAlarmScreen();
+void acquireEnvironment();
 void checkEnvironment();
-void handleLED();
+void updateSamplingRates();
+void sendExcursionBurst();
+void setupSignals();
+void updateSignals();
+void setSignal(uint8_t pin, SignalPattern& current, SignalPattern pattern);
 void checkAlarms();
-void handleAlarmTrigger();
 void stopAlarm();
 void snoozeAlarm();
-String getDayOfWeek(int day);
+uint32_t currentUtcEpoch();
+int addAlarm(int hour, int minute, int days);
+bool deleteAlarm(int id);
+void rescheduleAllAlarms();
+bool parseAlarmField(const char*& p, const char* end, int& value);
+void applyAlarmMessage(const char* action, const char* p, const char* end);
+void publishAlarmStatus(const char* event, const Alarm& alarm);
+void onTimeSync(struct timeval* tv);
+long currentUtcOffset();
 void handleButtons();
-void handleRightButton();
-void handleLeftButton();
-void handleUpButton();
-void handleDownButton();
+bool handleButtonEvent(const ButtonEvent& event);
+int wrapStep(int value, int delta, int count);
+bool openMenu();
+bool selectMenuItem();
+bool menuPrevious();
+bool menuNext();
+bool beginNewAlarm();
+bool beginViewAlarms();
+bool draftHourUp();
+bool draftHourDown();
+bool draftMinuteUp();
+bool draftMinuteDown();
+bool saveDraftAlarm();
+bool timeZoneNext();
+bool timeZonePrevious();
+bool alarmsPrevious();
+bool alarmsNext();
+bool beginDelete();
+bool confirmDelete();
+bool stopRingingAlarm();
 void updateDisplay();
+void requestRedraw();
 
 void connectToWiFi();
+void startNetwork();
+void lightSleep(unsigned long ms);
+bool isPowerIdle();
+bool noteUserActivity();
+void setDisplayPower(bool on);
+void reportPower();
+void resetProfile(struct TaskProfile& profile);
+void recordProfile(struct TaskProfile& profile, uint32_t cycles);
+uint32_t cyclesToMicros(uint32_t cycles);
+uint32_t profilePercentile(const struct TaskProfile& profile, float fraction);
+void publishDiagnostics();
+void setupTrace();
+void traceRecord(uint8_t type, const void* payload, uint16_t length, uint32_t time);
+void flushTrace();
+bool readReplayRecord();
+void replayUntil(uint32_t time);
+void checkHeap();
+void checkTaskHeap(int id, uint32_t heapBefore);
+void logBootPhase(const char* phase);
+bool isFaultReset();
+void setupDeviceTopics();
 void setupMqtt();
-void connectToBroker();
+bool connectToBroker();
+void serviceNetwork();
+void setNetState(NetState state);
+void loadWifiCache();
+void saveWifiCache();
 void recieveCallback(char *topic, byte *payload, unsigned int length);
 void adjustServo();
+void updateServoLaw();
+
+void updateClock();
+void setupLightSensor();
+void acquireLight();
+void sampleLight();
+void sendLightAverage();
+void sampleTelemetry();
+void recordTelemetrySample();
+void flushTelemetry();
+void checkReportByException(bool force);
+bool isNetworkOnline();
+void setupTelemetryStore();
+void storeTelemetryFrame(const TelemetryFrame& frame);
+void drainTelemetryStore();
+void commitStoreTail();
+void resetExcursionWindow();
+void updateExcursionAnalytics();
+void publishExcursionSummary();
+void serviceAlarmControl();
+bool publishMessage(const char* topic, const uint8_t* payload, unsigned int length);
+void applyConfigMessage(const char* topic, const byte* payload, unsigned int length);
+const char* deviceSubtopic(const char* topic);
+void applyDeviceMessage(const char* subtopic, const byte* payload, unsigned int length);
+int findConfigParam(const char* key, unsigned int length);
+bool parseConfigNumber(const char*& p, const char* end, float& value);
+bool parseConfigObject(const char* p, const char* end, float* staged, bool* present);
+void setConfigValue(int id, float value);
+uint32_t crc32(const uint8_t* data, size_t length);
+void loadSettings();
+void captureSettings(Settings& settings);
+void markSettingsDirty();
+void saveSettings();
+void processInboundMessages();
+void networkTask(void* param);
 
 // Interrupt Service Routines
-void IRAM_ATTR handleUpInterrupt() { 
-  if (millis() - lastInterruptTime > DEBOUNCE_TIME) { 
-    btnUpPressed = true; 
-    lastInterruptTime = millis(); 
-  } 
-}
+// All four pins trigger on CHANGE so both press and release are timestamped
+void IRAM_ATTR handleButtonEdge(uint8_t button) {
+  unsigned long now = millis();
+  bool pressed = digitalRead(buttonPins[button]) == LOW;  // Active LOW
+
+  if (!debounceButtonEdge(button, pressed, now)) return;
+
+  // While ringing, RIGHT and DOWN go straight to the alarm control path
+  if (pressed && currentState == ALARM_TRIGGERED) {
+    if (button == BUTTON_RIGHT) {
+      alarmEventQueue.push({ALARM_ACTION_STOP, micros()});
+      return;
+    }
+    if (button == BUTTON_DOWN) {
+      alarmEventQueue.push({ALARM_ACTION_SNOOZE, micros()});
+      return;
+    }
+  }
 
-void IRAM_ATTR handleLeftInterrupt() { 
-  if (millis() - lastInterruptTime > DEBOUNCE_TIME) { 
-    btnLeftPressed = true; 
-    lastInterruptTime = millis(); 
-  } 
+  buttonEventQueue.push({button, (uint8_t)(pressed ? EDGE_PRESS : EDGE_RELEASE), now});
 }
 
-void IRAM_ATTR handleDownInterrupt() { 
-  if (millis() - lastInterruptTime > DEBOUNCE_TIME) { 
-    btnDownPressed = true; 
-    if (currentState == ALARM_TRIGGERED) {
-      snoozeAlarmFlag = true;
-    }
-    lastInterruptTime = millis(); 
-  } 
+void IRAM_ATTR handleUpInterrupt() { handleButtonEdge(BUTTON_UP); }
+void IRAM_ATTR handleLeftInterrupt() { handleButtonEdge(BUTTON_LEFT); }
+void IRAM_ATTR handleDownInterrupt() { handleButtonEdge(BUTTON_DOWN); }
+void IRAM_ATTR handleRightInterrupt() { handleButtonEdge(BUTTON_RIGHT); }
+
+// MQTT traffic crossing between the network core and the UI core
+#define MQTT_TOPIC_MAX 64
+#define MQTT_PAYLOAD_MAX 256
+#define MQTT_QUEUE_LENGTH 8
+
+// Topics
+// Every box lives under medibox/<device id>/, the id being its factory MAC from eFuse,
+// so any number of boxes can share a broker. Config is also taken from the group
+// subtree medibox/<group>/config/..., so one retained message configures the fleet;
+// the box's own subtree is subscribed last, so its retained values win.
+#define TOPIC_ROOT "medibox/"
+#define DEVICE_GROUP "fleet"
+#define MQTT_SUBSCRIBE_QOS 1  // Retained config is redelivered until acknowledged
+#define MQTT_STATUS_QOS 1     // Will QoS; PubSubClient publishes everything else at QoS 0
+#define STATUS_ONLINE "online"
+#define STATUS_OFFLINE "offline"  // Retained will, sent by the broker when the link drops
+
+char deviceId[13];         // MAC as 12 hex digits
+char clientId[21];         // "medibox-" + deviceId
+char status_topic[MQTT_TOPIC_MAX];             // Retained STATUS_ONLINE / STATUS_OFFLINE
+char light_intensity_topic[MQTT_TOPIC_MAX];
+char alarm_latency_topic[MQTT_TOPIC_MAX];      // "last_us,worst_us"
+char telemetry_topic[MQTT_TOPIC_MAX];          // Binary TelemetryFrame
+char telemetry_backlog_topic[MQTT_TOPIC_MAX];  // Frames recorded offline
+char env_summary_topic[MQTT_TOPIC_MAX];        // Binary ExcursionSummary
+char power_topic[MQTT_TOPIC_MAX];              // "sleep_pct,est_mA"
+char diag_topic[MQTT_TOPIC_MAX];               // Heap, stack and loop summary
+
+// Config subtopics are config/<key>, one value each, or config/all with a flat
+// JSON object applied atomically
+#define CONFIG_SUBTOPIC "config/"
+#define CONFIG_ALL_KEY "all"
+#define CONFIG_KEY_MAX 24
+
+// Remote alarm management, from the box's own subtree only:
+//   alarms/set     "HH:MM" or "HH:MM,<weekday mask>"
+//   alarms/delete  "<id>" or "all"
+// Changes are confirmed on alarms/status
+#define ALARM_SUBTOPIC "alarms/"
+char alarm_status_topic[MQTT_TOPIC_MAX];
+
+// FNV-1a, evaluated at compile time for the dispatch table
+constexpr uint32_t fnv1a(const char* s, uint32_t hash = 2166136261u) {
+  return *s ? fnv1a(s + 1, (hash ^ (uint8_t)*s) * 16777619u) : hash;
 }
 
-void IRAM_ATTR handleRightInterrupt() { 
-  if (millis() - lastInterruptTime > DEBOUNCE_TIME) { 
-    btnRightPressed = true; 
-    if (currentState == ALARM_TRIGGERED) {
-      stopAlarmFlag = true;
-    }
-    lastInterruptTime = millis(); 
-  } 
+uint32_t fnv1aSpan(const char* s, unsigned int length) {
+  uint32_t hash = 2166136261u;
+  for (unsigned int i = 0; i < length; i++) hash = (hash ^ (uint8_t)s[i]) * 16777619u;
+  return hash;
 }
 
+enum ConfigId { CONFIG_SAMPLING_INTERVAL, CONFIG_SENDING_INTERVAL, CONFIG_AMP_TEMP,
+  CONFIG_CONTROL_FACTOR, CONFIG_MIN_ANGLE, CONFIG_COUNT };
 
+struct ConfigParam {
+  const char* key;
+  uint32_t hash;
+  float minValue;
+  float maxValue;
+};
 
-// Topics
-const char* light_intensity_topic = "medicine_storage/light_intensity";
-const char* sampling_interval_topic = "medicine_storage/config/sampling_interval";
-const char* sending_interval_topic = "medicine_storage/config/sending_interval";
-const char* amp_temp_topic = "medicine_storage/config/AmpTemp";
-const char* control_factor_topic = "medicine_storage/config/ControlFactor";
-const char* min_angle_topic = "medicine_storage/config/minAngle";
-
-// Default intervals (in milliseconds)
+// Order must match ConfigId
+const ConfigParam configParams[CONFIG_COUNT] = {
+  {"sampling_interval", fnv1a("sampling_interval"), 1,   3600},  // Seconds
+  {"sending_interval",  fnv1a("sending_interval"),  1,   1440},  // Minutes
+  {"AmpTemp",           fnv1a("AmpTemp"),           1,   60},    // degC
+  {"ControlFactor",     fnv1a("ControlFactor"),     0,   1},
+  {"minAngle",          fnv1a("minAngle"),          0,   120}    // Degrees
+};
+
+struct MqttMessage {
+  char topic[MQTT_TOPIC_MAX];
+  uint8_t payload[MQTT_PAYLOAD_MAX];
+  uint16_t length;
+};
+
+#if DUAL_CORE_MODE
+SpscQueue<MqttMessage, MQTT_QUEUE_LENGTH> outboundQueue;  // UI core -> network core
+SpscQueue<MqttMessage, MQTT_QUEUE_LENGTH> inboundQueue;   // network core -> UI core
+SpscQueue<MqttMessage, MQTT_QUEUE_LENGTH> failedQueue;    // network core -> UI core, unsent telemetry
+TaskHandle_t networkTaskHandle = NULL;
+#endif
+
+// Default intervals (in milliseconds), retuned at runtime over MQTT config
 unsigned long samplingInterval = 5000;    // 5 seconds
 unsigned long sendingInterval = 120000;  // 2 minutes
 
 // Variables for light measurement
 float lightIntensitySum = 0;
 int sampleCount = 0;
-unsigned long lastSampleTime = 0;
-unsigned long lastSendTime = 0;
 
 // Min and max values for calibration
 const int minLDRValue = 0;    // Minimum expected LDR reading (bright light)
 const int maxLDRValue = 4095; // Maximum expected LDR reading (dark)
 
+// Filtered light level, shared by the averaging stage and the servo
+struct LightSnapshot {
+  float level;              // Normalized 0 (dark) to 1 (bright), filtered
+  int raw;                  // Last decimated ADC value
+  unsigned long timestamp;  // millis() of the reading
+  bool valid;
+};
+LightSnapshot lightSnapshot = {0, 0, 0, false};
+
+// Batched telemetry, published as one binary frame per sendingInterval (or when full).
+// Little-endian, packed:
+//   header  u8 schema version, u8 sample count, u16 frame sequence
+//   sample  u32 UTC epoch, i16 temperature (0.01 C), u16 humidity (0.01 %),
+//           u16 light (1/10000), u8 servo angle (deg), u8 flags
+#define TELEMETRY_SCHEMA_VERSION 1
+#define TELEMETRY_BATCH 16
+#define TELEMETRY_FLAG_ALARM 0x01
+#define TELEMETRY_FLAG_ENV_WARNING 0x02
+#define TELEMETRY_FLAG_ENV_VALID 0x04
+
+// Report-by-exception: publish only when a channel leaves its deadband, a flag
+// changes or the heartbeat expires, instead of every sendingInterval
+#define TELEMETRY_REPORT_BY_EXCEPTION 0
+#define REPORT_HEARTBEAT_INTERVAL 900000  // 15 minutes
+
+struct __attribute__((packed)) TelemetrySample {
+  uint32_t epoch;
+  int16_t temperature;
+  uint16_t humidity;
+  uint16_t light;
+  uint8_t servoAngle;
+  uint8_t flags;
+};
+
+struct __attribute__((packed)) TelemetryFrame {
+  uint8_t version;
+  uint8_t count;
+  uint16_t sequence;
+  TelemetrySample samples[TELEMETRY_BATCH];
+};
+#define TELEMETRY_HEADER_SIZE (sizeof(TelemetryFrame) - sizeof(TelemetrySample) * TELEMETRY_BATCH)
+static_assert(sizeof(TelemetryFrame) <= MQTT_PAYLOAD_MAX, "Telemetry frame must fit one MQTT message");
+
+TelemetryFrame telemetryFrame = {TELEMETRY_SCHEMA_VERSION, 0, 0, {}};
+
+// Store-and-forward: frames that cannot be published are logged to a fixed-size
+// ring file in LittleFS and drained in rate-limited batches once back online.
+// Slot = sequence % STORE_CAPACITY, so writes walk the whole file evenly and the
+// newest records are found by scanning sequences at boot; no header is rewritten.
+// Off in replay, whose samples must never be stored and uploaded later.
+#define TELEMETRY_STORE_AND_FORWARD (TRACE_MODE != TRACE_REPLAY)
+#define STORE_CAPACITY 2048           // Records, 16 bytes each
+#define STORE_DRAIN_INTERVAL 1000     // One backlog frame per interval
+#define STORE_TAIL_COMMIT_BATCHES 8   // Persist the drain position every N frames
+#define STORE_LOG_PATH "/telemetry.log"
+#define STORE_TAIL_PATH "/telemetry.tail"
+
+struct __attribute__((packed)) StoredRecord {
+  uint32_t sequence;  // 0 marks an empty slot
+  TelemetrySample sample;
+};
+
+#if TELEMETRY_STORE_AND_FORWARD
+bool storeReady = false;
+uint32_t storeNextSequence = 1;   // Sequence of the next record written
+uint32_t storeTailSequence = 1;   // Oldest record not yet published
+int storeUncommittedBatches = 0;
+#endif
+
+#if TELEMETRY_REPORT_BY_EXCEPTION
+enum ReportChannelId { CHANNEL_TEMPERATURE, CHANNEL_HUMIDITY, CHANNEL_LIGHT, CHANNEL_SERVO,
+  CHANNEL_FLAGS, CHANNEL_COUNT };
+
+struct ReportChannel {
+  const char* name;
+  float deadband;      // Change since the last report that forces a new one
+  float lastReported;
+};
+
+// Order must match ReportChannelId
+ReportChannel reportChannels[CHANNEL_COUNT] = {
+  {"temperature", 0.5f,  0},
+  {"humidity",    2.0f,  0},
+  {"light",       0.05f, 0},
+  {"servo",       2.0f,  0},
+  {"flags",       0.5f,  0}   // Any alarm/warning flag change
+};
+unsigned long lastReportTime = 0;
+bool reportedOnce = false;
+#endif
+
+// Storage-excursion analytics
+// Each window keeps running statistics in O(1) memory and is published as one
+// ExcursionSummary when it closes, then reset (tumbling windows).
+#define EXCURSION_WINDOW 3600000   // ms per summary
+#define MKT_ACTIVATION 10000.0f    // deltaH / R in kelvin (83.144 kJ/mol, ICH default)
+
+// Welford running mean/variance with min/max
+struct RunningStats {
+  uint32_t count;
+  float mean;
+  float m2;
+  float min;
+  float max;
+};
+
+struct ExcursionWindow {
+  RunningStats temperature;
+  RunningStats humidity;
+  uint32_t startEpoch;
+  unsigned long startTime;
+  unsigned long lastSampleTime;
+  float lastTemperature;           // MKT and dwell time are weighted by the interval
+  float lastHumidity;              // that ends at each new sample
+  double mktSum;                   // Integral of exp(-dH/RT) dt, in ms
+  unsigned long weightedTime;      // Total dt integrated into mktSum
+  unsigned long tempAboveMs;
+  unsigned long tempBelowMs;
+  unsigned long humidityAboveMs;
+  unsigned long humidityBelowMs;
+};
+
+struct __attribute__((packed)) ExcursionSummary {
+  uint8_t version;
+  uint32_t startEpoch;             // UTC
+  uint32_t duration;               // Seconds
+  uint16_t samples;
+  int16_t tempMin, tempMax, tempMean, tempStdDev;  // degC x100
+  uint16_t humMin, humMax, humMean, humStdDev;     // %RH x100
+  int16_t meanKineticTemp;         // degC x100
+  uint32_t tempAbove, tempBelow;   // Seconds outside MIN_TEMP..MAX_TEMP
+  uint32_t humAbove, humBelow;     // Seconds outside MIN_HUMIDITY..MAX_HUMIDITY
+};
+
+ExcursionWindow excursionWindow;
+void resetRunningStats(RunningStats& stats);
+void updateRunningStats(RunningStats& stats, float value);
+
+#if LDR_CONTINUOUS_ADC
+uint8_t ldrAdcPins[] = {LDR_PIN};
+volatile bool ldrConversionDone = false;
+#endif
+
 // Sensors and Servo
 DHTesp dht;
+#if MEDIBOX_SERVO
 Servo servo;
+#endif
 
 // Default Parameters
 float theta_offset = 30.0f;    // offset (min angle)
 float T_med = 30.0f;           // T_med (ideal temp in °C)
-int ts = 5000;      // Sampling interval (ms)
-int tu = 120000;    // Sending interval (ms)
 float controlFactor = 0.75f;
 
+// Servo control law, theta = theta_offset + servoGain * light * temperature.
+// servoGain folds in every constant term and is recomputed only on config changes.
+float servoGain = 0;
+float servoAngle = -1;              // Last angle written, -1 until the first write
+unsigned long lastServoUpdate = 0;
+
+// Scheduler table, run by MediBoxScheduler.h
+enum TaskId { TASK_NETWORK, TASK_CLOCK, TASK_BUTTONS, TASK_ALARM_CONTROL, TASK_ENVIRONMENT,
+  TASK_LIGHT, TASK_ALARMS, TASK_DISPLAY, TASK_SIGNALS, TASK_SERVO, TASK_LIGHT_SAMPLE, TASK_LIGHT_SEND,
+  TASK_TELEMETRY_DRAIN, TASK_SETTINGS, TASK_POWER,
+#if ENABLE_PROFILING
+  TASK_DIAG,  // Nothing looks this one up, so it has no row at all when profiling is off
+#endif
+  TASK_TRACE, TASK_HEAP, TASK_COUNT };
+
+// Order must match TaskId
+Task tasks[TASK_COUNT] = {
+#if DUAL_CORE_MODE
+  {"mqttInbox",    processInboundMessages,  50,                       0, true, true},
+#else
+  {"network",      serviceNetwork,          50,                       0, true, true},
+#endif
+  {"clock",        updateClock,             100,                      0, true, true},
+  {"buttons",      handleButtons,           10,                       0, true, true},
+  {"alarmControl", serviceAlarmControl,     10,                       0, true, false},
+  {"environment",  acquireEnvironment,      ENV_CHECK_INTERVAL,       0, true, true},
+#if MEDIBOX_LIGHT_TELEMETRY
+  {"light",        acquireLight,            LDR_ACQUIRE_INTERVAL,     0, true, true},
+#else
+  {"light",        NULL,                    LDR_ACQUIRE_INTERVAL,     0, false, false},
+#endif
+  {"alarms",       checkAlarms,             1000,                     0, true, true},
+  {"display",      updateDisplay,           100,                      0, true, false},
+  {"signals",      updateSignals,           250,                      0, true, true},
+#if MEDIBOX_SERVO
+  {"servo",        adjustServo,             500,                      0, true, true},
+#else
+  {"servo",        NULL,                    500,                      0, false, false},
+#endif
+#if MEDIBOX_LIGHT_TELEMETRY
+  {"lightSample",  sampleLight,             samplingInterval,         0, true, true},
+  {"lightSend",    sendLightAverage,        sendingInterval,          0, !TELEMETRY_REPORT_BY_EXCEPTION, true},
+#else
+  // No LDR module: the same periods still build and send the telemetry frame
+  {"sample",       sampleTelemetry,         samplingInterval,         0, true, true},
+  {"send",         flushTelemetry,          sendingInterval,          0, !TELEMETRY_REPORT_BY_EXCEPTION, true},
+#endif
+#if TELEMETRY_STORE_AND_FORWARD
+  {"drain",        drainTelemetryStore,     STORE_DRAIN_INTERVAL,     0, true, true},
+#else
+  {"drain",        NULL,                    STORE_DRAIN_INTERVAL,     0, false, true},
+#endif
+#if TRACE_MODE != TRACE_REPLAY  // Replay never writes NVS
+  {"settings",     saveSettings,            1000,                     0, true, true},
+#else
+  {"settings",     NULL,                    1000,                     0, false, false},
+#endif
+#if LOW_POWER_MODE
+  {"power",        reportPower,             POWER_REPORT_INTERVAL,    0, true, true},
+#else
+  {"power",        NULL,                    POWER_REPORT_INTERVAL,    0, false, false},
+#endif
+#if ENABLE_PROFILING
+  {"diag",         publishDiagnostics,      PROFILE_PUBLISH_INTERVAL, 0, true, true},
+#endif
+#if TRACE_MODE == TRACE_RECORD
+  {"trace",        flushTrace,              TRACE_FLUSH_INTERVAL,     0, true, true},
+#else
+  {"trace",        NULL,                    TRACE_FLUSH_INTERVAL,     0, false, false},
+#endif
+#if HEAP_CHECK
+  {"heap",         checkHeap,               HEAP_CHECK_INTERVAL,      0, true, true}
+#else
+  {"heap",         NULL,                    HEAP_CHECK_INTERVAL,      0, false, false}
+#endif
+};
+const int taskCount = TASK_COUNT;
+
+#if ENABLE_PROFILING
+struct TaskProfile {
+  uint32_t runs;
+  uint32_t minCycles;
+  uint32_t maxCycles;
+  uint64_t totalCycles;
+  uint32_t overruns;                  // Started more than a full period late
+  uint16_t histogram[PROFILE_BUCKETS];
+};
+TaskProfile taskProfiles[TASK_COUNT];
+TaskProfile loopProfile;              // Whole scheduler passes
+uint32_t loopOverruns = 0;
+unsigned long lastDiagReport = 0;
+int diagCursor = -1;                  // Task being published, -1 between reports
+#endif
+
+#if TRACE_MODE != TRACE_OFF
+enum TraceType : uint8_t { TRACE_CLOCK, TRACE_ENVIRONMENT, TRACE_LIGHT, TRACE_BUTTON, TRACE_CONFIG,
+                           TRACE_ALARM_ACTION };
+
+// Every record is this header followed by `length` payload bytes
+struct __attribute__((packed)) TraceHeader {
+  uint32_t time;    // halMillis() when the input arrived
+  uint8_t type;
+  uint16_t length;
+};
+
+struct __attribute__((packed)) TraceEnvironment {
+  float temperature;
+  float humidity;
+  uint8_t ok;
+};
+
+// TRACE_CLOCK carries a uint32_t epoch, TRACE_LIGHT a uint16_t raw reading,
+// TRACE_BUTTON {button, edge}, TRACE_CONFIG the subtopic, a NUL, then the payload, and
+// TRACE_ALARM_ACTION the uint8_t AlarmAction of a stop/snooze press (these skip the
+// button queue, so they are recorded where serviceAlarmControl() takes them)
+#define TRACE_PAYLOAD_MAX (MQTT_TOPIC_MAX + MQTT_PAYLOAD_MAX)
+
+File traceFile;
+#if TRACE_MODE == TRACE_RECORD
+uint32_t traceBytes = 0;
+#else
+uint32_t virtualMillis = 0;       // Replay clock behind halMillis()
+bool replayActive = false;
+TraceHeader replayHeader;         // Next record, read ahead so halDelay() knows when it is due
+uint8_t replayPayload[TRACE_PAYLOAD_MAX + 1];
+uint32_t replayEpoch = 0;         // Wall clock at replayEpochAt
+uint32_t replayEpochAt = 0;
+HalEnvironment replayEnvironment = {NAN, NAN, "no trace reading yet"};
+int replayLightRaw = 0;
+bool replayLightFresh = false;
+uint32_t replayRecords = 0;
+uint32_t replayTraceStart = 0;    // Virtual time of the first record
+unsigned long replayStartedAt = 0;  // Real millis() when replay began
+#endif
+#endif
+
+// Period the task currently runs at; 0 when disabled or suspended while idle
+unsigned long taskPeriod(const Task& task) {
+  if (!task.enabled) return 0;
+#if LOW_POWER_MODE
+  if (powerIdle) {
+    return task.idleRun ? max(task.period, (unsigned long)IDLE_MIN_PERIOD) : 0;
+  }
+#endif
+  return task.period;
+}
+
+// One task run, with profiling and heap checks around it
+void runTask(int id) {
+#if HEAP_CHECK
+  bool heapWatched = id == TASK_CLOCK || id == TASK_DISPLAY;
+  uint32_t heapBefore = heapWatched ? ESP.getFreeHeap() : 0;
+#endif
+#if ENABLE_PROFILING
+  // Called before the deadline advances, so lateness is still measurable
+  if ((long)(halMillis() - tasks[id].nextRun) >= (long)taskPeriod(tasks[id])) taskProfiles[id].overruns++;
+  uint32_t start = ESP.getCycleCount();
+  tasks[id].run();
+  recordProfile(taskProfiles[id], ESP.getCycleCount() - start);
+#else
+  tasks[id].run();
+#endif
+#if HEAP_CHECK
+  if (heapWatched) checkTaskHeap(id, heapBefore);
+#endif
+}
+
+#if ENABLE_PROFILING
+void resetProfile(TaskProfile& profile) {
+  uint32_t overruns = profile.overruns;
+  memset(&profile, 0, sizeof(profile));
+  profile.minCycles = UINT32_MAX;
+  profile.overruns = overruns;  // Overruns are cumulative since boot
+}
+
+// Constant time per sample: min/max/sum plus one histogram bucket
+void recordProfile(TaskProfile& profile, uint32_t cycles) {
+  profile.runs++;
+  profile.totalCycles += cycles;
+  if (cycles < profile.minCycles) profile.minCycles = cycles;
+  if (cycles > profile.maxCycles) profile.maxCycles = cycles;
+
+  uint32_t us = cyclesToMicros(cycles);
+  int bucket = us == 0 ? 0 : 32 - __builtin_clz(us);  // Bucket b holds [2^(b-1), 2^b) us
+  if (bucket >= PROFILE_BUCKETS) bucket = PROFILE_BUCKETS - 1;
+  if (profile.histogram[bucket] < UINT16_MAX) profile.histogram[bucket]++;
+}
+
+uint32_t cyclesToMicros(uint32_t cycles) {
+  return cycles / ESP.getCpuFreqMHz();
+}
+
+// Upper edge of the histogram bucket containing the percentile, in us
+uint32_t profilePercentile(const TaskProfile& profile, float fraction) {
+  uint32_t target = (uint32_t)ceilf(profile.runs * fraction);
+  uint32_t seen = 0;
+  for (int bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+    seen += profile.histogram[bucket];
+    if (seen >= target) return 1UL << bucket;
+  }
+  return cyclesToMicros(profile.maxCycles);
+}
+
+// Publishes a summary, then one task per run until the table has been covered
+void publishDiagnostics() {
+  char payload[96];
+  int length;
+
+  if (diagCursor < 0) {
+    if (halMillis() - lastDiagReport < PROFILE_REPORT_INTERVAL) return;
+    lastDiagReport = halMillis();
+
+    // "free_heap,min_heap,loop_stack,net_stack,loop_overruns,p99_pass_us,max_pass_us"
+    uint32_t networkStack = 0;
+#if DUAL_CORE_MODE
+    networkStack = uxTaskGetStackHighWaterMark(networkTaskHandle);
+#endif
+    length = snprintf(payload, sizeof(payload), "%lu,%lu,%lu,%lu,%lu,%lu,%lu",
+                      (unsigned long)ESP.getFreeHeap(), (unsigned long)ESP.getMinFreeHeap(),
+                      (unsigned long)uxTaskGetStackHighWaterMark(NULL), (unsigned long)networkStack,
+                      (unsigned long)loopOverruns, (unsigned long)profilePercentile(loopProfile, 0.99f),
+                      (unsigned long)cyclesToMicros(loopProfile.maxCycles));
+    publishMessage(diag_topic, (const uint8_t*)payload, length);
+    Serial.print("Diag: ");
+    Serial.println(payload);
+    resetProfile(loopProfile);
+    diagCursor = 0;
+    return;
+  }
+
+  // medibox/<id>/diag/<task>: "runs,min_us,mean_us,p99_us,max_us,overruns"
+  const TaskProfile& profile = taskProfiles[diagCursor];
+  char topic[MQTT_TOPIC_MAX];
+  int topicLength = snprintf(topic, sizeof(topic), "%s/%s", diag_topic, tasks[diagCursor].name);
+  if (profile.runs > 0 && topicLength < (int)sizeof(topic)) {  // Never publish on a cut-off topic
+    length = snprintf(payload, sizeof(payload), "%lu,%lu,%lu,%lu,%lu,%lu",
+                      (unsigned long)profile.runs,
+                      (unsigned long)cyclesToMicros(profile.minCycles),
+                      (unsigned long)cyclesToMicros((uint32_t)(profile.totalCycles / profile.runs)),
+                      (unsigned long)profilePercentile(profile, 0.99f),
+                      (unsigned long)cyclesToMicros(profile.maxCycles),
+                      (unsigned long)profile.overruns);
+    publishMessage(topic, (const uint8_t*)payload, length);
+  }
+  resetProfile(taskProfiles[diagCursor]);
+  if (++diagCursor == TASK_COUNT) diagCursor = -1;
+}
+#endif
+
 void setup() {
   Serial.begin(115200);
+  bootPhaseStart = millis();
   Wire.begin(OLED_SDA, OLED_SCL);
   if(!display.begin(SSD1306_SWITCHCAPVCC, OLED_ADDR)) {
     Serial.println("OLED allocation failed");
     while(1);
   }
+  logBootPhase("display");
 
   // Initialize Buttons with interrupts
   pinMode(BTN_UP, INPUT_PULLUP);
   pinMode(BTN_LEFT, INPUT_PULLUP);
   pinMode(BTN_DOWN, INPUT_PULLUP);
   pinMode(BTN_RIGHT, INPUT_PULLUP);
-  pinMode(BUZZER_PIN, OUTPUT);
-  pinMode(LED_PIN, OUTPUT);
   
-  attachInterrupt(digitalPinToInterrupt(BTN_UP), handleUpInterrupt, FALLING);
-  attachInterrupt(digitalPinToInterrupt(BTN_LEFT), handleLeftInterrupt, FALLING);
-  attachInterrupt(digitalPinToInterrupt(BTN_DOWN), handleDownInterrupt, FALLING);
-  attachInterrupt(digitalPinToInterrupt(BTN_RIGHT), handleRightInterrupt, FALLING);
-  
-  displayWelcome();
-  delay(2000);
-  // Initialize WiFi
-  connectToWiFi() ;
-  
-  // Initialize MQTT
-  setupMqtt();
-// Initialize NTP client
-    timeClient.begin();
-    updateTimeZone();
-
-      // Turn LED on initially
-  digitalWrite(LED_PIN, HIGH);
+  attachInterrupt(digitalPinToInterrupt(BTN_UP), handleUpInterrupt, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(BTN_LEFT), handleLeftInterrupt, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(BTN_DOWN), handleDownInterrupt, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(BTN_RIGHT), handleRightInterrupt, CHANGE);
+
+  // Saved alarms and parameters are in place before the network is even started
+#if TRACE_MODE == TRACE_REPLAY
+  // Every run of a trace starts from the same state: the built-in defaults
+  captureSettings(savedSettings);
+#else
+  loadSettings();
+#endif
+  logBootPhase("settings");
+#if TRACE_MODE != TRACE_OFF
+  setupTrace();
+  logBootPhase("trace");
+#endif
+
+  // Buzzer off, LED on
+  setupSignals();
   
+#if MEDIBOX_LIGHT_TELEMETRY
   // Configure LDR pin
-  pinMode(LDR_PIN, INPUT);
-  pinMode(LED_PIN, OUTPUT);
+  setupLightSensor();
+#endif
   dht.setup(DHT_PIN, DHTesp::DHT11);
+  // Never poll the DHT faster than it can produce a fresh reading
+  tasks[TASK_ENVIRONMENT].period = max((unsigned long)ENV_CHECK_INTERVAL,
+                                       (unsigned long)dht.getMinimumSamplingPeriod());
+#if ADAPTIVE_SAMPLING
+  envFastInterval = tasks[TASK_ENVIRONMENT].period;  // Boot samples fast until the first reading
+#endif
+#if MEDIBOX_SERVO
   servo.attach(SERVO_PIN);  // Initialize servo
-}
+  updateServoLaw();
+#endif
+  logBootPhase("sensors");
 
-void loop() {
-  if(!mqttClient.connected()){
-    connectToBroker();
-  }
-  mqttClient.loop();      //Keeps the connection to the MQTT broker alive (sends periodic "ping" packets)
-  //Processes incoming network traffic//Triggers your callback function (if you've defined one) for received messages
-  unsigned long currentTime = millis();
-  timeClient.update();
-  handleButtons();
-  checkEnvironment();
-  updateDisplay();
-  checkAlarms();
-  handleLED();
-
-  adjustServo();
-  delay(100);
-  // Take light samples at the configured interval
-  if (currentTime - lastSampleTime >= samplingInterval) {
-    lastSampleTime = currentTime;
-    
-    // Read LDR value (0-4095 for ESP32)
-    int ldrValue = analogRead(LDR_PIN);
-    
-    // Convert to normalized value (0-1)
-    float normalizedValue = 1.0 - ((float)ldrValue - minLDRValue) / (maxLDRValue - minLDRValue);
-    //normalizedValue = constrain(normalizedValue, 0.0, 1.0);
-    
-    lightIntensitySum += normalizedValue;
-    sampleCount++;
-    
-    Serial.print("Sample taken: ");
-    Serial.print(normalizedValue, 4);
-    Serial.print(" (Raw: ");
-    Serial.print(ldrValue);
-    Serial.println(")");
+  // After a brownout or crash, go straight back to monitoring instead of the welcome screen
+  if (isFaultReset()) {
+    Serial.println("Resuming after fault reset");
+    currentState = SHOW_TIME;
+  } else {
+    displayWelcome();
+    flushDisplay(display, OLED_ADDR);
+#if !FAST_BOOT
+    delay(2000);
+#endif
   }
+
+#if TELEMETRY_STORE_AND_FORWARD
+  setupTelemetryStore();
+  logBootPhase("telemetry store");
+#endif
+  // Initialize MQTT
+  setupDeviceTopics();
+  setupMqtt();
+#if TRACE_MODE == TRACE_REPLAY
+  tasks[TASK_NETWORK].enabled = false;  // Config messages come from the trace
+#elif FAST_BOOT
+  startNetwork();  // serviceNetwork() brings the link up from the scheduler
+#else
+  connectToWiFi();
+#endif
   
-  // Send average light intensity at the configured interval
-  if (currentTime - lastSendTime >= sendingInterval) {
-    lastSendTime = currentTime;
-    
-    float averageIntensity = lightIntensitySum / sampleCount;
-    
-    // Publish the average light intensity
-    char intensityStr[8];
-    dtostrf(averageIntensity, 1, 4, intensityStr);
-    mqttClient.publish(light_intensity_topic, intensityStr);
-    
-    Serial.print("Average light intensity sent: ");
-    Serial.println(averageIntensity, 4);
-    
-    // Reset for next averaging period
-    lightIntensitySum = 0;
-    sampleCount = 0;
-    if (alarmTriggered) {
-      handleAlarmTrigger();
-    }
-    
-    // Check for immediate alarm actions
-    if (stopAlarmFlag) {
-      stopAlarmFlag = false;
-      stopAlarm();
-    }
-    
-    if (snoozeAlarmFlag) {
-      snoozeAlarmFlag = false;
-      snoozeAlarm();
-    }
-    
-  
-  }
+  // Start SNTP; the clock keeps whatever time the RTC held until the first sync
+  sntp_set_time_sync_notification_cb(onTimeSync);
+  sntp_set_sync_interval(NTP_SYNC_INTERVAL);
+  configTzTime(timeZones[timeZoneIndex].rule, NTP_SERVER);
+  updateTimeZone();
+  logBootPhase("network");
+
+#if DUAL_CORE_MODE && TRACE_MODE != TRACE_REPLAY
+  // MQTT, reconnects and NTP run on their own core so a network stall
+  // cannot hold up alarms, buttons or the display
+  xTaskCreatePinnedToCore(networkTask, "network", NETWORK_TASK_STACK, NULL, 1,
+                          &networkTaskHandle, NETWORK_CORE);
+#endif
+  startScheduler();
+#if ENABLE_PROFILING
+  for (int i = 0; i < TASK_COUNT; i++) resetProfile(taskProfiles[i]);
+  resetProfile(loopProfile);
+  lastDiagReport = halMillis();
+#endif
+#if FAST_BOOT
+  // First readings and frame now rather than one period from now
+  runTaskNow(TASK_ENVIRONMENT);
+#if MEDIBOX_LIGHT_TELEMETRY
+  runTaskNow(TASK_LIGHT);
+#endif
+  runTaskNow(TASK_DISPLAY);
+#endif
+
+  Serial.print("Boot complete in ");
+  Serial.print(millis());
+  Serial.print(" ms, free heap ");
+  Serial.println(ESP.getFreeHeap());
+}
 
+// Prints how long the boot step that just finished took
+void logBootPhase(const char* phase) {
+  unsigned long now = millis();
+  Serial.print("Boot: ");
+  Serial.print(phase);
+  Serial.print(" ");
+  Serial.print(now - bootPhaseStart);
+  Serial.println(" ms");
+  bootPhaseStart = now;
+}
 
+bool isFaultReset() {
+  switch (esp_reset_reason()) {
+    case ESP_RST_BROWNOUT:
+    case ESP_RST_PANIC:
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:
+      return true;
+    default:
+      return false;
+  }
 }
 
-void setupMqtt(){
-  mqttClient.setServer("test.mosquitto.org",1883); // server for MQTT -->mosquito.org
-   mqttClient.setCallback(recieveCallback);
+#if HEAP_CHECK
+// The first run sets the baseline; later runs report when free heap has drifted below it
+void checkHeap() {
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (heapBaseline == 0) {
+    heapBaseline = freeHeap;
+    Serial.print("Heap: baseline ");
+    Serial.println(heapBaseline);
+    return;
+  }
+  if (freeHeap + HEAP_DRIFT_LIMIT < heapBaseline) {
+    Serial.print("Heap: ");
+    Serial.print(heapBaseline - freeHeap);
+    Serial.print(" bytes below baseline, min free ");
+    Serial.println(ESP.getMinFreeHeap());
+  }
+}
+
+void checkTaskHeap(int id, uint32_t heapBefore) {
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (freeHeap >= heapBefore) return;
+  heapAllocatingRuns++;
+  Serial.print("Heap: ");
+  Serial.print(tasks[id].name);
+  Serial.print(" run kept ");
+  Serial.print(heapBefore - freeHeap);
+  Serial.print(" bytes (");
+  Serial.print(heapAllocatingRuns);
+  Serial.println(" so far)");
 }
-void connectToBroker(){
-  while(!mqttClient.connected()){
-    Serial.println("Attempting MQTT connection");
-    if(mqttClient.connect("ESP32-12345645454")){                   //this should be deleted 
-      Serial.println("MQTT connected");
-      mqttClient.subscribe(sampling_interval_topic);
-      mqttClient.subscribe(sending_interval_topic);
-      mqttClient.subscribe(amp_temp_topic);
-      mqttClient.subscribe(control_factor_topic);
-      mqttClient.subscribe(min_angle_topic);
-
-   
-    }else{
-      Serial.println("FAILED");
-      Serial.println(mqttClient.state());
-      delay(5000);
+#endif
+
+void loop() {
+#if LOW_POWER_MODE
+  powerIdle = isPowerIdle();
+#endif
+#if ENABLE_PROFILING
+  uint32_t passStart = ESP.getCycleCount();
+#endif
+  unsigned long wait = runScheduler();
+#if ENABLE_PROFILING
+  uint32_t passCycles = ESP.getCycleCount() - passStart;
+  recordProfile(loopProfile, passCycles);
+  if (cyclesToMicros(passCycles) > LOOP_BUDGET_US) loopOverruns++;
+#endif
+  if (wait > 0) {
+#if LOW_POWER_MODE
+    // Light sleep drops the Wi-Fi association, so while a link is up (or coming up)
+    // idle time is spent in modem sleep instead, under delay()
+    bool linkWanted = netState != NET_WIFI_BACKOFF && netState != NET_MQTT_BACKOFF;
+    if (powerIdle && !linkWanted && wait >= LIGHT_SLEEP_MIN) {
+      lightSleep(wait);
+      return;
     }
+#endif
+    halDelay(wait);
   }
 }
-void recieveCallback(char* topic, byte* payload, unsigned int length) {
-  Serial.print("Message arrived [");
-  Serial.print(topic);
-  Serial.print("] ");
 
-  char message[length + 1];
-  for (int i = 0; i < length; i++) message[i] = (char)payload[i];
-  message[length] = '\0';
+#if LOW_POWER_MODE
+// Sleeps until the next task deadline or a button press
+void lightSleep(unsigned long ms) {
+  for (uint8_t button = 0; button < BUTTON_COUNT; button++) {
+    gpio_wakeup_enable((gpio_num_t)buttonPins[button], GPIO_INTR_LOW_LEVEL);  // Active LOW
+  }
+  esp_sleep_enable_gpio_wakeup();
+  esp_sleep_enable_timer_wakeup((uint64_t)ms * 1000);
+
+  unsigned long start = halMillis();  // Keeps counting through light sleep
+  esp_light_sleep_start();
+  sleepTimeInWindow += halMillis() - start;
+
+  // Wake-up config replaced the pins' interrupt type; put the CHANGE edges back
+  for (uint8_t button = 0; button < BUTTON_COUNT; button++) {
+    gpio_wakeup_disable((gpio_num_t)buttonPins[button]);
+    gpio_set_intr_type((gpio_num_t)buttonPins[button], GPIO_INTR_ANYEDGE);
+  }
 
-  if (strcmp(topic, sampling_interval_topic) == 0) ts = atoi(message) * 1000;
-  else if (strcmp(topic,sending_interval_topic) == 0) tu = atoi(message) * 60000;
-  else if (strcmp(topic, min_angle_topic) == 0) theta_offset = atof(message);
-  else if (strcmp(topic, control_factor_topic) == 0)controlFactor= (float)atof(message);
-  else if (strcmp(topic, amp_temp_topic) == 0) T_med = atof(message);
+  // The press that woke us only turns the screen back on. Its edges may still be
+  // queued after the ISRs come back, so drop presses for one more debounce window.
+  if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO) {
+    noteUserActivity();
+    wokenAt = halMillis() + DEBOUNCE_TIME;
+    wakeFilter = true;
+  }
 }
 
+// Light sleep stops LEDC and the loop, so only sleep when nothing is being signalled
+bool isPowerIdle() {
+  return displayBlanked && !alarmTriggered &&
+         buzzerPattern == SIGNAL_OFF && ledPattern != SIGNAL_BLINK;
+}
 
-void adjustServo() {
-  // Read sensorsldrValue
-  int ldrValue = analogRead(LDR_PIN);
-  float normalized_lightIntensity = 1.0 - ((float)  ldrValue) / (maxLDRValue - minLDRValue);
-  float temperature = dht.getTemperature();
+// Returns true if the screen was blanked, so the press should only wake it
+bool noteUserActivity() {
+  lastUserActivity = halMillis();
+  if (!displayBlanked) return false;
+  wokenAt = lastUserActivity;
+  wakeFilter = true;
+  setDisplayPower(true);
+  return true;
+}
 
-  // Calculate servo angle using the equation
-  float theta = theta_offset + 
-              (180.0f - theta_offset) *       // Ensure float arithmetic
-              normalized_lightIntensity * 
-              controlFactor * 
-              log((float)ts / (float)tu) *    // Explicitly cast to float for log()
-              (temperature / T_med);           // Already floats
-
-  theta = constrain(theta, theta_offset, 180.0);  // Limit to valid servo range
-  servo.write(theta);
-  Serial.print("theta: ");
-  Serial.println(theta);
+void setDisplayPower(bool on) {
+  display.ssd1306_command(on ? SSD1306_DISPLAYON : SSD1306_DISPLAYOFF);
+  displayBlanked = !on;
+  if (on) {
+    requestRedraw();
+    runTaskNow(TASK_DISPLAY);
+  }
+}
+
+// Average current is estimated from the time split between light sleep and
+// everything else; there is no current sensor on the board
+void reportPower() {
+  unsigned long now = halMillis();
+  unsigned long window = now - powerWindowStart;
+  if (window == 0) return;
+  float sleepFraction = (float)sleepTimeInWindow / window;
+  float averageCurrent = sleepFraction * LIGHT_SLEEP_CURRENT_MA +
+                         (1 - sleepFraction) * ACTIVE_CURRENT_MA;
+  powerWindowStart = now;
+  sleepTimeInWindow = 0;
+
+  char report[32];
+  sprintf(report, "%.1f,%.2f", sleepFraction * 100, averageCurrent);  // "sleep %,est mA"
+  publishMessage(power_topic, (const uint8_t*)report, strlen(report));
+  Serial.print("Power: ");
+  Serial.print(sleepFraction * 100, 1);
+  Serial.print("% asleep, est. ");
+  Serial.print(averageCurrent, 2);
+  Serial.println(" mA");
 }
+#endif
+
+// Advances the Wi-Fi/MQTT connection without ever blocking for more than one
+// bounded broker connect attempt; failures back off exponentially
+void serviceNetwork() {
+  unsigned long elapsed = halMillis() - netStateSince;
+  bool wifiUp = WiFi.status() == WL_CONNECTED;
+
+  switch (netState) {
+    case NET_WIFI_START:
+      WiFi.disconnect();
+      wifiFastConnect = wifiCache.magic == WIFI_CACHE_MAGIC;
+      if (wifiFastConnect) {
+        // Skip the scan by going straight to the last access point and channel
+        WiFi.begin(ssid, password, wifiCache.channel, wifiCache.bssid);
+      } else {
+        WiFi.begin(ssid, password);
+      }
+      setNetState(NET_WIFI_CONNECTING);
+      break;
 
+    case NET_WIFI_CONNECTING:
+      if (wifiUp) {
+        Serial.print("WiFi connected, IP: ");
+        Serial.println(WiFi.localIP());
+        saveWifiCache();
+        netBackoff = NET_BACKOFF_MIN;
+        setNetState(NET_MQTT_CONNECT);
+      } else if (wifiFastConnect && elapsed > WIFI_FAST_CONNECT_TIMEOUT) {
+        // Access point moved or changed channel; fall back to a full scan
+        Serial.println("WiFi fast connect failed");
+        wifiCache.magic = 0;
+        setNetState(NET_WIFI_START);
+      } else if (elapsed > WIFI_CONNECT_TIMEOUT) {
+        Serial.println("WiFi connect timed out");
+        WiFi.disconnect();
+        setNetState(NET_WIFI_BACKOFF);
+      }
+      break;
 
+    case NET_WIFI_BACKOFF:
+      if (elapsed >= netBackoff) {
+        netBackoff = min(netBackoff * 2, (unsigned long)NET_BACKOFF_MAX);
+        setNetState(NET_WIFI_START);
+      }
+      break;
 
+    case NET_MQTT_CONNECT:
+      if (!wifiUp) {
+        setNetState(NET_WIFI_START);
+      } else if (connectToBroker()) {
+        netBackoff = NET_BACKOFF_MIN;
+        setNetState(NET_ONLINE);
+      } else {
+        netJitter = random(netBackoff / 2 + 1);
+        setNetState(NET_MQTT_BACKOFF);
+      }
+      break;
 
+    case NET_MQTT_BACKOFF:
+      if (!wifiUp) {
+        setNetState(NET_WIFI_START);
+      } else if (elapsed >= netBackoff + netJitter) {
+        netBackoff = min(netBackoff * 2, (unsigned long)NET_BACKOFF_MAX);
+        setNetState(NET_MQTT_CONNECT);
+      }
+      break;
 
-void connectToWiFi() {
-  display.clearDisplay();
-  display.setTextSize(1);
-  display.setCursor(0, 0);
-  display.println("Connecting to WiFi");
-  display.println(ssid);
-  display.display();
-  
-  WiFi.begin(ssid, password);
-  
-  int attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-    delay(500);
-    display.print(".");
-    display.display();
-    attempts++;
-  }
-  
-  if (WiFi.status() != WL_CONNECTED) {
-    display.clearDisplay();
-    display.setCursor(0, 0);
-    display.println("WiFi Failed!");
-    display.println("Retrying...");
-    display.display();
-    delay(2000);
-    connectToWiFi();
-    return;
+    case NET_ONLINE:
+      if (!wifiUp) {
+        Serial.println("WiFi lost");
+        setNetState(NET_WIFI_START);
+      } else if (!mqttClient.connected()) {
+        Serial.println("MQTT connection lost");
+        setNetState(NET_MQTT_CONNECT);
+      } else {
+        mqttClient.loop();      //Keeps the connection to the MQTT broker alive (sends periodic "ping" packets)
+        //Processes incoming network traffic//Triggers your callback function (if you've defined one) for received messages
+      }
+      break;
   }
-  
-  display.clearDisplay();
-  display.setCursor(0, 0);
-  display.println("WiFi Connected!");
-  display.print("IP: ");
-  display.println(WiFi.localIP());
-  display.display();
-  delay(1000);
 }
 
+void setNetState(NetState state) {
+  netState = state;
+  netStateSince = halMillis();
+}
 
-void updateTimeZone() {
-  timeClient.setTimeOffset(timeZoneOffset);
+void loadWifiCache() {
+  wifiPrefs.begin(PREFS_NAMESPACE, true);
+  if (wifiPrefs.getBytes("wifi", &wifiCache, sizeof(wifiCache)) != sizeof(wifiCache) ||
+      wifiCache.magic != WIFI_CACHE_MAGIC) {
+    wifiCache = {};
+  }
+  wifiPrefs.end();
 }
 
-void displayWelcome() {
-  display.clearDisplay();
-  display.setTextSize(2);
-  display.setCursor(0, 10);
-  display.println("  MEDIBOX");
-  display.setTextSize(1);
-  display.setCursor(0, 35);
-  display.println("Press RIGHT to begin");
-  display.display();
+// Stores the current access point, writing flash only when it changed
+void saveWifiCache() {
+  WifiCache current = {};
+  current.magic = WIFI_CACHE_MAGIC;
+  memcpy(current.bssid, WiFi.BSSID(), sizeof(current.bssid));
+  current.channel = WiFi.channel();
+
+  if (memcmp(&current, &wifiCache, sizeof(current)) == 0) return;
+  wifiCache = current;
+  wifiPrefs.begin(PREFS_NAMESPACE, false);
+  wifiPrefs.putBytes("wifi", &wifiCache, sizeof(wifiCache));
+  wifiPrefs.end();
 }
 
-void checkEnvironment() {
-  if (millis() - lastEnvCheck > ENV_CHECK_INTERVAL) {
-    temperature = dht.getTemperature();
-     humidity = dht.getHumidity();
-    lastEnvCheck = millis();
-    
-    // Check if values are within limits
-    envWarning = (temperature < MIN_TEMP || temperature > MAX_TEMP || 
-                 humidity < MIN_HUMIDITY || humidity > MAX_HUMIDITY);
-    
-    // Activate buzzer if limits exceeded (unless alarm is ringing)
-    if (envWarning && !alarmTriggered) {
-      digitalWrite(BUZZER_PIN, HIGH);
-    } else {
-      digitalWrite(BUZZER_PIN, LOW);
-    }
+// Cheap when the second has not changed: one time() call and a compare
+void updateClock() {
+  if (clockSynced) {
+    clockSynced = false;
+    rescheduleAllAlarms();  // The clock may have stepped under the table
+#if TRACE_MODE == TRACE_RECORD
+    uint32_t epoch = halTime();
+    traceRecord(TRACE_CLOCK, &epoch, sizeof(epoch), halMillis());
+#endif
   }
+
+  time_t now = halTime();
+  if (now == clockCache.epoch) return;
+  clockCache.epoch = now;
+  clockCache.valid = now >= MIN_VALID_EPOCH;
+  const struct tm& local = clockCache.local;
+  localtime_r(&now, &clockCache.local);
+  snprintf(clockCache.time, sizeof(clockCache.time), "%02d:%02d:%02d",
+           local.tm_hour, local.tm_min, local.tm_sec);
+  snprintf(clockCache.date, sizeof(clockCache.date), "%02d/%02d/%04d %s",
+           local.tm_mday, local.tm_mon + 1, local.tm_year + 1900, weekdayNames[local.tm_wday]);
 }
 
-void handleLED() {
-  if (envWarning) {
-    // Blink LED if warning
-    if (millis() - lastLedToggle > LED_TOGGLE_INTERVAL) {
-      digitalWrite(LED_PIN, !digitalRead(LED_PIN));
-      lastLedToggle = millis();
+// Runs in the SNTP task, so only leaves a flag for updateClock()
+void onTimeSync(struct timeval* tv) {
+  clockSynced = true;
+}
+
+// Seconds east of UTC right now, including DST
+long currentUtcOffset() {
+  struct tm utc;
+  gmtime_r(&clockCache.epoch, &utc);
+  utc.tm_isdst = -1;
+  return (long)(clockCache.epoch - mktime(&utc));
+}
+
+#if DUAL_CORE_MODE
+void networkTask(void* param) {
+  MqttMessage msg;
+  for (;;) {
+    serviceNetwork();
+    while (outboundQueue.pop(msg)) {
+      if (mqttClient.publish(msg.topic, msg.payload, msg.length)) continue;
+#if TELEMETRY_STORE_AND_FORWARD
+      // The UI core already counted the frame as sent; hand it back to be stored
+      if (strcmp(msg.topic, telemetry_topic) == 0 || strcmp(msg.topic, telemetry_backlog_topic) == 0) {
+        failedQueue.push(msg);
+      }
+#endif
     }
-  } else {
-    // Keep LED on if no warning
-    digitalWrite(LED_PIN, HIGH);
+    vTaskDelay(pdMS_TO_TICKS(10));
   }
 }
 
-void displayTime() {
-  display.clearDisplay();
-  
-  // Display time (large)
-  display.setTextSize(2);
-  display.setCursor(0, 10);
-  String formattedTime = timeClient.getFormattedTime();
-  display.println(formattedTime);
-  
-  // Display date (medium)
-  display.setTextSize(1);
-  display.setCursor(0, 35);
-  
-  time_t epochTime = timeClient.getEpochTime();
-  struct tm *ptm = gmtime(&epochTime);
-  
-  char dateString[30];
-  sprintf(dateString, "%02d/%02d/%04d %s", 
-         ptm->tm_mday, ptm->tm_mon+1, ptm->tm_year+1900,
-         getDayOfWeek(ptm->tm_wday).c_str());
-  display.println(dateString);
-  
-  // Display environmental data
-  display.setCursor(0, 50);
-  display.print(temperature, 1);
-  display.print("C ");
-  display.print(humidity, 0);
-  display.print("%");
-  
-  // Show warning indicator if needed
-  if (envWarning) {
-    display.setCursor(110, 50);
-    display.print("!");
-    
-    // Display warning message
-    display.setCursor(0, 0);
-    if (temperature < MIN_TEMP) display.print("LOW TEMP! ");
-    if (temperature > MAX_TEMP) display.print("HIGH TEMP! ");
-    if (humidity < MIN_HUMIDITY) display.print("LOW HUM! ");
-    if (humidity > MAX_HUMIDITY) display.print("HIGH HUM! ");
+// Applies config messages handed over by the network core
+void processInboundMessages() {
+  MqttMessage msg;
+  while (inboundQueue.pop(msg)) {
+    applyConfigMessage(msg.topic, msg.payload, msg.length);
   }
-  
-  // Display alarm indicators
-  for (int i = 0; i < 2; i++) {
-    if (alarms[i].active) {
-      display.setCursor(110, i * 10);
-      display.print("A");
-      display.print(i+1);
-    }
+#if TELEMETRY_STORE_AND_FORWARD
+  // Frames the broker refused go to the store like any other unsent frame
+  while (failedQueue.pop(msg)) {
+    TelemetryFrame frame;
+    memcpy(&frame, msg.payload, min((size_t)msg.length, sizeof(frame)));
+    storeTelemetryFrame(frame);
   }
+#endif
+}
+#endif
+
+// Publishes directly, or hands the message to the network core in dual-core mode
+bool publishMessage(const char* topic, const uint8_t* payload, unsigned int length) {
+#if DUAL_CORE_MODE
+  MqttMessage msg;
+  if (strlen(topic) >= MQTT_TOPIC_MAX || length > MQTT_PAYLOAD_MAX) return false;
+  strcpy(msg.topic, topic);
+  memcpy(msg.payload, payload, length);
+  msg.length = length;
+  return outboundQueue.push(msg);
+#else
+  return mqttClient.publish(topic, payload, length);
+#endif
 }
 
-void checkAlarms() {
-  if (alarmTriggered) return;
-  
-  int currentHour = timeClient.getHours();
-  int currentMinute = timeClient.getMinutes();
-  unsigned long currentMillis = millis();
-  
-  for (int i = 0; i < 2; i++) {
-    // Handle snoozed alarms
-    if (alarms[i].snoozed) {
-      if (currentMillis - alarms[i].snoozeStartTime >= SNOOZE_DURATION) {
-        alarms[i].snoozed = false;
-        // Reactivate the alarm for the next minute
-        alarms[i].hour = currentHour;
-        alarms[i].minute = currentMinute;
-      } else {
-        continue; // Skip if still in snooze period
-      }
-    }
-    
-    if (alarms[i].active && !alarms[i].ringing &&
-        alarms[i].hour == currentHour && 
-        alarms[i].minute == currentMinute) {
-      alarms[i].ringing = true;
-      alarmTriggered = true;
-      currentState = ALARM_TRIGGERED;
-    }
+#if MEDIBOX_LIGHT_TELEMETRY
+#if LDR_CONTINUOUS_ADC
+void ARDUINO_ISR_ATTR onLdrConversion() {
+  ldrConversionDone = true;
+}
+#endif
+
+void setupLightSensor() {
+#if LDR_CONTINUOUS_ADC
+  // The driver DMA-fills a buffer and averages LDR_OVERSAMPLE conversions per result
+  analogContinuousSetWidth(12);
+  analogContinuousSetAtten(ADC_11db);
+  analogContinuous(ldrAdcPins, 1, LDR_OVERSAMPLE, LDR_ADC_FREQUENCY, &onLdrConversion);
+  analogContinuousStart();
+#else
+  pinMode(LDR_PIN, INPUT);
+#endif
+}
+
+// Updates the filtered light level; in continuous mode this only picks up
+// the latest decimated result and never waits on a conversion
+void acquireLight() {
+  int raw;
+  if (!halReadLight(raw)) return;
+
+  // Convert to normalized value (0-1)
+  float level = 1.0 - ((float)raw - minLDRValue) / (maxLDRValue - minLDRValue);
+  if (lightSnapshot.valid) {
+    level = lightSnapshot.level + LDR_FILTER_ALPHA * (level - lightSnapshot.level);
   }
+  lightSnapshot.level = level;
+  lightSnapshot.raw = raw;
+  lightSnapshot.timestamp = halMillis();
+  lightSnapshot.valid = true;
 }
 
-void handleAlarmTrigger() {
-  static unsigned long lastBeep = 0;
-  static bool buzzerState = false;
-  
-  // Override environmental warning buzzer
-  digitalWrite(BUZZER_PIN, LOW);
+// Take light samples at the configured interval
+void sampleLight() {
+  if (!lightSnapshot.valid) return;
+  float normalizedValue = lightSnapshot.level;
   
-  // Buzzer beeping (500ms on, 500ms off)
-  if (millis() - lastBeep > 500) {
-    buzzerState = !buzzerState;
-    digitalWrite(BUZZER_PIN, buzzerState ? HIGH : LOW);
-    lastBeep = millis();
-  }
+  lightIntensitySum += normalizedValue;
+  sampleCount++;
+  recordTelemetrySample();
+#if TELEMETRY_REPORT_BY_EXCEPTION
+  checkReportByException(false);
+#endif
   
-  // Display alarm message with current time
-  display.clearDisplay();
+  Serial.print("Sample taken: ");
+  Serial.print(normalizedValue, 4);
+  Serial.print(" (Raw: ");
+  Serial.print(lightSnapshot.raw);
+  Serial.println(")");
+}
+
+// Send average light intensity at the configured interval
+void sendLightAverage() {
+  if (sampleCount > 0) {
+    float averageIntensity = lightIntensitySum / sampleCount;
+    
+    // Publish the average light intensity
+    char intensityStr[8];
+    dtostrf(averageIntensity, 1, 4, intensityStr);
+    publishMessage(light_intensity_topic, (const uint8_t*)intensityStr, strlen(intensityStr));
+    
+    Serial.print("Average light intensity sent: ");
+    Serial.println(averageIntensity, 4);
+  }
   
-  // Show current time at top
+  // Reset for next averaging period
+  lightIntensitySum = 0;
+  sampleCount = 0;
+
+  flushTelemetry();
+}
+#else
+// Takes telemetry samples at the configured interval (sampleLight() does this with the LDR)
+void sampleTelemetry() {
+  recordTelemetrySample();
+#if TELEMETRY_REPORT_BY_EXCEPTION
+  checkReportByException(false);
+#endif
+}
+#endif
+
+// Appends the current readings to the pending telemetry frame
+void recordTelemetrySample() {
+  TelemetrySample& sample = telemetryFrame.samples[telemetryFrame.count];
+  sample.epoch = currentUtcEpoch();
+  sample.temperature = (int16_t)lroundf(envSnapshot.temperature * 100);
+  sample.humidity = (uint16_t)lroundf(envSnapshot.humidity * 100);
+  sample.light = (uint16_t)lroundf(constrain(lightSnapshot.level, 0.0f, 1.0f) * 10000);
+  sample.servoAngle = servoAngle < 0 ? 0 : (uint8_t)lroundf(servoAngle);
+  sample.flags = (alarmTriggered ? TELEMETRY_FLAG_ALARM : 0) |
+                 (envWarning ? TELEMETRY_FLAG_ENV_WARNING : 0) |
+                 (envSnapshot.valid ? TELEMETRY_FLAG_ENV_VALID : 0);
+
+  if (++telemetryFrame.count == TELEMETRY_BATCH) {
+#if TELEMETRY_REPORT_BY_EXCEPTION
+    // Keep a rolling window of the latest samples until something is worth reporting
+    memmove(&telemetryFrame.samples[0], &telemetryFrame.samples[1],
+            sizeof(TelemetrySample) * (TELEMETRY_BATCH - 1));
+    telemetryFrame.count--;
+#else
+    flushTelemetry();
+#endif
+  }
+}
+
+#if TELEMETRY_REPORT_BY_EXCEPTION
+// Publishes the pending frame and light average if any channel moved beyond its
+// deadband, the heartbeat expired, or force is set (threshold crossings)
+void checkReportByException(bool force) {
+  float values[CHANNEL_COUNT];
+  values[CHANNEL_TEMPERATURE] = envSnapshot.temperature;
+  values[CHANNEL_HUMIDITY] = envSnapshot.humidity;
+  values[CHANNEL_LIGHT] = lightSnapshot.level;
+  values[CHANNEL_SERVO] = servoAngle;
+  values[CHANNEL_FLAGS] = (alarmTriggered ? TELEMETRY_FLAG_ALARM : 0) |
+                          (envWarning ? TELEMETRY_FLAG_ENV_WARNING : 0);
+
+  bool due = force || !reportedOnce || halMillis() - lastReportTime >= REPORT_HEARTBEAT_INTERVAL;
+  for (int i = 0; i < CHANNEL_COUNT && !due; i++) {
+    if (fabsf(values[i] - reportChannels[i].lastReported) >= reportChannels[i].deadband) {
+      Serial.print("Report by exception: ");
+      Serial.println(reportChannels[i].name);
+      due = true;
+    }
+  }
+  if (!due) return;
+
+  for (int i = 0; i < CHANNEL_COUNT; i++) {
+    reportChannels[i].lastReported = values[i];
+  }
+  lastReportTime = halMillis();
+  reportedOnce = true;
+#if MEDIBOX_LIGHT_TELEMETRY
+  sendLightAverage();
+#else
+  flushTelemetry();
+#endif
+}
+#endif
+
+void flushTelemetry() {
+  if (telemetryFrame.count == 0) return;
+  bool sent = isNetworkOnline() &&
+              publishMessage(telemetry_topic, (const uint8_t*)&telemetryFrame,
+                             TELEMETRY_HEADER_SIZE + telemetryFrame.count * sizeof(TelemetrySample));
+#if TELEMETRY_STORE_AND_FORWARD
+  if (!sent) {
+    storeTelemetryFrame(telemetryFrame);
+  }
+#else
+  (void)sent;  // Without the store an unsent frame is dropped
+#endif
+  telemetryFrame.sequence++;
+  telemetryFrame.count = 0;
+}
+
+bool isNetworkOnline() {
+  return netState == NET_ONLINE;
+}
+
+#if TELEMETRY_STORE_AND_FORWARD
+void setupTelemetryStore() {
+  if (!LittleFS.begin(true)) {
+    Serial.println("LittleFS mount failed, offline buffering disabled");
+    return;
+  }
+
+  File log = LittleFS.open(STORE_LOG_PATH, "r");
+  if (!log || log.size() != STORE_CAPACITY * sizeof(StoredRecord)) {
+    // First boot (or capacity changed): preallocate the ring with empty slots
+    if (log) log.close();
+    log = LittleFS.open(STORE_LOG_PATH, "w");
+    if (!log) return;
+    StoredRecord empty = {};
+    for (int i = 0; i < STORE_CAPACITY; i++) {
+      log.write((const uint8_t*)&empty, sizeof(empty));
+    }
+    log.close();
+  } else {
+    // Resume after the newest record
+    StoredRecord record;
+    while (log.read((uint8_t*)&record, sizeof(record)) == sizeof(record)) {
+      if (record.sequence >= storeNextSequence) storeNextSequence = record.sequence + 1;
+    }
+    log.close();
+  }
+
+  File tail = LittleFS.open(STORE_TAIL_PATH, "r");
+  if (tail) {
+    tail.read((uint8_t*)&storeTailSequence, sizeof(storeTailSequence));
+    tail.close();
+  }
+  if (storeTailSequence > storeNextSequence) storeTailSequence = storeNextSequence;
+  if (storeNextSequence - storeTailSequence > STORE_CAPACITY) {
+    storeTailSequence = storeNextSequence - STORE_CAPACITY;
+  }
+  storeReady = true;
+
+  Serial.print("Telemetry backlog: ");
+  Serial.print(storeNextSequence - storeTailSequence);
+  Serial.println(" records");
+}
+
+// Appends a frame's samples to the ring, overwriting the oldest once full
+void storeTelemetryFrame(const TelemetryFrame& frame) {
+  if (!storeReady) return;
+  File log = LittleFS.open(STORE_LOG_PATH, "r+");
+  if (!log) return;
+
+  for (int i = 0; i < frame.count && i < TELEMETRY_BATCH; i++) {
+    StoredRecord record = {storeNextSequence, frame.samples[i]};
+    log.seek((storeNextSequence % STORE_CAPACITY) * sizeof(StoredRecord));
+    log.write((const uint8_t*)&record, sizeof(record));
+    storeNextSequence++;
+  }
+  log.close();
+
+  if (storeNextSequence - storeTailSequence > STORE_CAPACITY) {
+    storeTailSequence = storeNextSequence - STORE_CAPACITY;  // Oldest records were overwritten
+  }
+}
+
+// Publishes one frame of backlog per call while online
+void drainTelemetryStore() {
+  if (!storeReady || storeTailSequence == storeNextSequence || !isNetworkOnline()) return;
+
+  File log = LittleFS.open(STORE_LOG_PATH, "r");
+  if (!log) return;
+
+  TelemetryFrame frame = {TELEMETRY_SCHEMA_VERSION, 0, (uint16_t)storeTailSequence, {}};
+  uint32_t sequence = storeTailSequence;
+  while (frame.count < TELEMETRY_BATCH && sequence != storeNextSequence) {
+    StoredRecord record;
+    log.seek((sequence % STORE_CAPACITY) * sizeof(StoredRecord));
+    if (log.read((uint8_t*)&record, sizeof(record)) == sizeof(record) && record.sequence == sequence) {
+      frame.samples[frame.count++] = record.sample;
+    }
+    sequence++;
+  }
+  log.close();
+
+  if (frame.count > 0 &&
+      !publishMessage(telemetry_backlog_topic, (const uint8_t*)&frame,
+                      TELEMETRY_HEADER_SIZE + frame.count * sizeof(TelemetrySample))) {
+    return;  // Retry on the next drain tick
+  }
+  storeTailSequence = sequence;
+
+  // Coalesce tail writes; a reboot in between re-sends at most a few frames
+  if (++storeUncommittedBatches >= STORE_TAIL_COMMIT_BATCHES || storeTailSequence == storeNextSequence) {
+    commitStoreTail();
+  }
+}
+
+void commitStoreTail() {
+  File tail = LittleFS.open(STORE_TAIL_PATH, "w");
+  if (!tail) return;
+  tail.write((const uint8_t*)&storeTailSequence, sizeof(storeTailSequence));
+  tail.close();
+  storeUncommittedBatches = 0;
+}
+#endif
+
+// Services stop/snooze presses every scheduler tick
+void serviceAlarmControl() {
+  AlarmEvent event;
+  while (alarmEventQueue.pop(event)) {
+#if TRACE_MODE == TRACE_RECORD
+    uint8_t action = event.action;
+    traceRecord(TRACE_ALARM_ACTION, &action, sizeof(action), halMillis());
+#endif
+    if (!alarmTriggered) continue;  // Already silenced by an earlier event
+
+    if (event.action == ALARM_ACTION_STOP) {
+      stopAlarm();
+    } else {
+      snoozeAlarm();
+    }
+
+    lastSilenceLatency = micros() - event.pressedAt;
+    if (lastSilenceLatency > worstSilenceLatency) {
+      worstSilenceLatency = lastSilenceLatency;
+    }
+    Serial.print("Alarm silenced in ");
+    Serial.print(lastSilenceLatency);
+    Serial.print(" us (worst ");
+    Serial.print(worstSilenceLatency);
+    Serial.println(" us)");
+
+    char latencyStr[24];
+    sprintf(latencyStr, "%lu,%lu", lastSilenceLatency, worstSilenceLatency);
+    publishMessage(alarm_latency_topic, (const uint8_t*)latencyStr, strlen(latencyStr));
+    runTaskNow(TASK_DISPLAY);
+  }
+}
+
+// Derives the device id and every topic from the factory MAC
+void setupDeviceTopics() {
+  uint64_t mac = ESP.getEfuseMac();  // Byte 0 of the MAC in the low bits
+  for (int i = 0; i < 6; i++) {
+    sprintf(deviceId + i * 2, "%02x", (unsigned)((mac >> (8 * i)) & 0xFF));
+  }
+  snprintf(clientId, sizeof(clientId), "medibox-%s", deviceId);
+
+  struct { char* topic; const char* leaf; } topics[] = {
+    {status_topic,            "status"},
+    {light_intensity_topic,   "light_intensity"},
+    {alarm_latency_topic,     "alarm_latency"},
+    {telemetry_topic,         "telemetry"},
+    {telemetry_backlog_topic, "telemetry_backlog"},
+    {env_summary_topic,       "env_summary"},
+    {power_topic,             "power"},
+    {diag_topic,              "diag"},
+    {alarm_status_topic,      ALARM_SUBTOPIC "status"}
+  };
+  for (auto& entry : topics) {
+    snprintf(entry.topic, MQTT_TOPIC_MAX, TOPIC_ROOT "%s/%s", deviceId, entry.leaf);
+  }
+  Serial.print("Device id: ");
+  Serial.println(deviceId);
+}
+
+void setupMqtt(){
+  mqttClient.setServer("test.mosquitto.org",1883); // server for MQTT -->mosquito.org
+   mqttClient.setCallback(recieveCallback);
+  mqttClient.setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+  myWifiClient.setConnectionTimeout(MQTT_CONNECT_TIMEOUT);
+  mqttClient.setBufferSize(MQTT_TOPIC_MAX + MQTT_PAYLOAD_MAX + 16);  // Room for a full telemetry frame
+}
+
+// Makes a single connection attempt; retries are paced by serviceNetwork()
+bool connectToBroker(){
+  Serial.println("Attempting MQTT connection");
+  if (mqttClient.connect(clientId, status_topic, MQTT_STATUS_QOS, true, STATUS_OFFLINE)) {
+    Serial.println("MQTT connected");
+    mqttClient.publish(status_topic, STATUS_ONLINE, true);
+
+    // Retained config arrives straight after each subscribe, group first
+    char filter[MQTT_TOPIC_MAX];
+    snprintf(filter, sizeof(filter), TOPIC_ROOT DEVICE_GROUP "/" CONFIG_SUBTOPIC "+");
+    mqttClient.subscribe(filter, MQTT_SUBSCRIBE_QOS);
+    snprintf(filter, sizeof(filter), TOPIC_ROOT "%s/" CONFIG_SUBTOPIC "+", deviceId);
+    mqttClient.subscribe(filter, MQTT_SUBSCRIBE_QOS);
+    snprintf(filter, sizeof(filter), TOPIC_ROOT "%s/" ALARM_SUBTOPIC "+", deviceId);
+    mqttClient.subscribe(filter, MQTT_SUBSCRIBE_QOS);
+    return true;
+  }
+  Serial.println("FAILED");
+  Serial.println(mqttClient.state());
+  return false;
+}
+void recieveCallback(char* topic, byte* payload, unsigned int length) {
+  Serial.print("Message arrived [");
+  Serial.print(topic);
+  Serial.print("] ");
+
+#if DUAL_CORE_MODE
+  // Runs on the network core; the config itself is applied on the UI core
+  MqttMessage msg;
+  if (strlen(topic) >= MQTT_TOPIC_MAX || length > MQTT_PAYLOAD_MAX) return;
+  strcpy(msg.topic, topic);
+  memcpy(msg.payload, payload, length);
+  msg.length = length;
+  inboundQueue.push(msg);
+#else
+  applyConfigMessage(topic, payload, length);
+#endif
+}
+
+void applyConfigMessage(const char* topic, const byte* payload, unsigned int length) {
+  const char* subtopic = deviceSubtopic(topic);
+  if (subtopic != NULL) applyDeviceMessage(subtopic, payload, length);
+}
+
+// What follows medibox/<device id>/ or medibox/<group>/ (config only); NULL if
+// the topic is not addressed to this box
+const char* deviceSubtopic(const char* topic) {
+  const size_t rootLength = sizeof(TOPIC_ROOT) - 1;
+  if (strncmp(topic, TOPIC_ROOT, rootLength) != 0) return NULL;
+  const char* owner = topic + rootLength;
+  const char* slash = strchr(owner, '/');
+  if (slash == NULL) return NULL;
+  size_t ownerLength = slash - owner;
+  const char* subtopic = slash + 1;
+
+  if (ownerLength == strlen(deviceId) && strncmp(owner, deviceId, ownerLength) == 0) {
+    return subtopic;
+  }
+  if (ownerLength == sizeof(DEVICE_GROUP) - 1 && strncmp(owner, DEVICE_GROUP, ownerLength) == 0 &&
+      strncmp(subtopic, CONFIG_SUBTOPIC, sizeof(CONFIG_SUBTOPIC) - 1) == 0) {
+    return subtopic;
+  }
+  return NULL;
+}
+
+// Parses the payload where it lies; nothing is copied or allocated
+void applyDeviceMessage(const char* subtopic, const byte* payload, unsigned int length) {
+#if TRACE_MODE == TRACE_RECORD
+  // Recorded here rather than in recieveCallback(), which may run on the network
+  // core, and without the device id so the trace replays on any box
+  uint8_t record[TRACE_PAYLOAD_MAX + 1];
+  size_t topicLength = strlen(subtopic);
+  if (topicLength < MQTT_TOPIC_MAX && length <= MQTT_PAYLOAD_MAX) {
+    memcpy(record, subtopic, topicLength + 1);
+    memcpy(record + topicLength + 1, payload, length);
+    traceRecord(TRACE_CONFIG, record, topicLength + 1 + length, halMillis());
+  }
+#endif
+  const char* p = (const char*)payload;
+  const char* end = p + length;
+  const size_t alarmPrefixLength = sizeof(ALARM_SUBTOPIC) - 1;
+  if (strncmp(subtopic, ALARM_SUBTOPIC, alarmPrefixLength) == 0) {
+    applyAlarmMessage(subtopic + alarmPrefixLength, p, end);
+    return;
+  }
+
+  const size_t prefixLength = sizeof(CONFIG_SUBTOPIC) - 1;
+  if (strncmp(subtopic, CONFIG_SUBTOPIC, prefixLength) != 0) return;
+  const char* key = subtopic + prefixLength;
+
+  if (strcmp(key, CONFIG_ALL_KEY) == 0) {
+    // Stage every field first so a bad message changes nothing
+    float staged[CONFIG_COUNT];
+    bool present[CONFIG_COUNT] = {};
+    if (!parseConfigObject(p, end, staged, present)) {
+      Serial.println("Rejected config object");
+      return;
+    }
+    for (int i = 0; i < CONFIG_COUNT; i++) {
+      if (present[i]) setConfigValue(i, staged[i]);
+    }
+  } else {
+    int id = findConfigParam(key, strlen(key));
+    float value;
+    if (id < 0) return;
+    if (!parseConfigNumber(p, end, value) || p != end ||
+        value < configParams[id].minValue || value > configParams[id].maxValue) {
+      Serial.print("Rejected ");
+      Serial.println(configParams[id].key);
+      return;
+    }
+    setConfigValue(id, value);
+  }
+
+#if MEDIBOX_SERVO
+  updateServoLaw();
+#endif
+}
+
+int findConfigParam(const char* key, unsigned int length) {
+  uint32_t hash = fnv1aSpan(key, length);
+  for (int i = 0; i < CONFIG_COUNT; i++) {
+    if (configParams[i].hash == hash && strncmp(configParams[i].key, key, length) == 0 &&
+        configParams[i].key[length] == '\0') {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Reads a decimal number such as "-12.5" and skips surrounding whitespace.
+// Advances p past what was consumed; fails on anything else.
+bool parseConfigNumber(const char*& p, const char* end, float& value) {
+  while (p < end && isspace((unsigned char)*p)) p++;
+  bool negative = p < end && *p == '-';
+  if (negative || (p < end && *p == '+')) p++;
+
+  float result = 0;
+  float scale = 1;
+  bool digits = false;
+  bool fraction = false;
+  for (; p < end; p++) {
+    if (*p >= '0' && *p <= '9') {
+      digits = true;
+      if (fraction) {
+        scale /= 10;
+        result += (*p - '0') * scale;
+      } else {
+        result = result * 10 + (*p - '0');
+      }
+    } else if (*p == '.' && !fraction) {
+      fraction = true;
+    } else {
+      break;
+    }
+  }
+  while (p < end && isspace((unsigned char)*p)) p++;
+  value = negative ? -result : result;
+  return digits;
+}
+
+// Flat object of numbers, e.g. {"sampling_interval": 5, "minAngle": 30}
+bool parseConfigObject(const char* p, const char* end, float* staged, bool* present) {
+  while (p < end && isspace((unsigned char)*p)) p++;
+  if (p == end || *p++ != '{') return false;
+
+  for (bool first = true; ; first = false) {
+    while (p < end && isspace((unsigned char)*p)) p++;
+    if (first && p < end && *p == '}') break;          // Empty object
+    if (p == end || *p++ != '"') return false;
+
+    const char* key = p;
+    while (p < end && *p != '"') p++;
+    if (p == end || p - key > CONFIG_KEY_MAX) return false;
+    int id = findConfigParam(key, p - key);
+    p++;
+
+    while (p < end && isspace((unsigned char)*p)) p++;
+    if (p == end || *p++ != ':') return false;
+
+    float value;
+    if (id < 0 || !parseConfigNumber(p, end, value)) return false;
+    if (value < configParams[id].minValue || value > configParams[id].maxValue) return false;
+    staged[id] = value;
+    present[id] = true;
+
+    if (p < end && *p == ',') {
+      p++;
+      continue;
+    }
+    if (p < end && *p == '}') break;
+    return false;
+  }
+
+  p++;
+  while (p < end && isspace((unsigned char)*p)) p++;
+  return p == end;
+}
+
+// Reads a whole number such as "23" and skips surrounding whitespace; a sign or
+// fraction is left unconsumed, so the caller's end check rejects "7.5" or "-1"
+bool parseAlarmField(const char*& p, const char* end, int& value) {
+  while (p < end && isspace((unsigned char)*p)) p++;
+  const char* start = p;
+  value = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; p++) {
+    if (value > 9999) return false;  // Far beyond any field, and no overflow
+    value = value * 10 + (*p - '0');
+  }
+  while (p < end && isspace((unsigned char)*p)) p++;
+  return p != start;
+}
+
+void applyAlarmMessage(const char* action, const char* p, const char* end) {
+  int value;
+  if (strcmp(action, "set") == 0) {
+    int hour, minute;
+    int days = ALARM_EVERY_DAY;
+    if (!parseAlarmField(p, end, hour) || p == end || *p++ != ':' ||
+        !parseAlarmField(p, end, minute)) {
+      Serial.println("Rejected alarm");
+      return;
+    }
+    if (p < end && *p == ',') {
+      p++;
+      if (!parseAlarmField(p, end, days)) p = NULL;
+    }
+    if (p != end || hour < 0 || hour > 23 || minute < 0 || minute > 59 ||
+        days < 1 || days > ALARM_EVERY_DAY) {
+      Serial.println("Rejected alarm");
+      return;
+    }
+    addAlarm(hour, minute, days);
+  } else if (strcmp(action, "delete") == 0) {
+    if (end - p == 3 && strncmp(p, "all", 3) == 0) {
+      while (alarmCount > 0) deleteAlarm(alarms[alarmCount - 1].id);
+    } else if (parseAlarmField(p, end, value) && p == end) {
+      deleteAlarm(value);
+    }
+  }
+}
+
+void setConfigValue(int id, float value) {
+  switch (id) {
+    case CONFIG_SAMPLING_INTERVAL:
+      samplingInterval = (unsigned long)lroundf(value * 1000);
+      setTaskPeriod(TASK_LIGHT_SAMPLE, samplingInterval);
+      break;
+    case CONFIG_SENDING_INTERVAL:
+      sendingInterval = (unsigned long)lroundf(value * 60000);
+      setTaskPeriod(TASK_LIGHT_SEND, sendingInterval);
+      break;
+    case CONFIG_AMP_TEMP:          T_med = value; break;
+    case CONFIG_CONTROL_FACTOR:    controlFactor = value; break;
+    case CONFIG_MIN_ANGLE:         theta_offset = value; break;
+  }
+  markSettingsDirty();
+}
+
+#if MEDIBOX_SERVO
+void updateServoLaw() {
+  if (samplingInterval == 0 || sendingInterval == 0 || T_med == 0) {
+    Serial.println("Invalid servo parameters, holding minimum angle");
+    servoGain = 0;
+    return;
+  }
+  servoGain = (180.0f - theta_offset) * controlFactor * logf((float)samplingInterval / (float)sendingInterval) / T_med;
+}
+
+
+void adjustServo() {
+  if (!envSnapshot.valid || !lightSnapshot.valid) return;  // No readings yet
+
+  float normalized_lightIntensity = lightSnapshot.level;
+
+  // Calculate servo angle using the equation
+  float theta = theta_offset + servoGain * normalized_lightIntensity * envSnapshot.temperature;
+  theta = constrain(theta, theta_offset, 180.0f);  // Limit to valid servo range
+
+  unsigned long now = halMillis();
+  float maxStep = SERVO_SLEW_RATE * (now - lastServoUpdate) / 1000.0f;
+  lastServoUpdate = now;
+
+  // Ignore jitter inside the deadband so the servo is not rewritten every run
+  if (servoAngle >= 0 && fabsf(theta - servoAngle) < SERVO_DEADBAND) return;
+
+  // Move towards the target no faster than the slew rate
+  if (servoAngle >= 0) {
+    theta = servoAngle + constrain(theta - servoAngle, -maxStep, maxStep);
+  }
+  servoAngle = theta;
+  halWriteServo((int)lroundf(theta));
+  Serial.print("theta: ");
+  Serial.println(theta);
+}
+#endif
+
+
+
+
+
+// Waits a bounded time at boot for Wi-Fi; if it is not up yet, the
+// connection manager keeps trying in the background
+void connectToWiFi() {
+  display.clearDisplay();
   display.setTextSize(1);
   display.setCursor(0, 0);
-  String formattedTime = timeClient.getFormattedTime();
-  display.println(formattedTime);
+  display.println("Connecting to WiFi");
+  display.println(ssid);
+  flushDisplay(display, OLED_ADDR);
   
-  // Show environmental data
-  display.setCursor(70, 0);
-  display.print(temperature, 1);
-  display.print("C ");
-  display.print(humidity, 0);
-  display.print("%");
+  startNetwork();
+
+  unsigned long start = millis();
+  unsigned long lastDot = start;
+  while (netState < NET_MQTT_CONNECT && millis() - start < WIFI_CONNECT_TIMEOUT) {
+    serviceNetwork();
+    if (millis() - lastDot >= 500) {
+      display.print(".");
+      flushDisplay(display, OLED_ADDR);
+      lastDot = millis();
+    }
+    delay(10);
+  }
   
-  // Show alarm message
+  display.clearDisplay();
+  display.setCursor(0, 0);
+  if (WiFi.status() != WL_CONNECTED) {
+    display.println("WiFi offline");
+    display.println("Retrying in background");
+    flushDisplay(display, OLED_ADDR);
+    return;
+  }
+  display.println("WiFi Connected!");
+  display.print("IP: ");
+  display.println(WiFi.localIP());
+  flushDisplay(display, OLED_ADDR);
+  delay(1000);
+}
+
+// Non-blocking: only arms the connection manager
+void startNetwork() {
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(false);  // Reconnects are owned by serviceNetwork()
+  loadWifiCache();
+  setNetState(NET_WIFI_START);
+#if LOW_POWER_MODE
+  WiFi.setSleep(WIFI_PS_MAX_MODEM);  // Radio wakes only for DTIM beacons
+#endif
+}
+
+void updateTimeZone() {
+  setenv("TZ", timeZones[timeZoneIndex].rule, 1);
+  tzset();
+  clockCache.epoch = 0;  // Force the cached local time to be recomputed
+  updateClock();
+  rescheduleAllAlarms();  // Alarm times are local
+  markSettingsDirty();
+}
+
+// Bitwise CRC-32 (IEEE); the blob is small and only checked at boot and on save
+uint32_t crc32(const uint8_t* data, size_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+void loadSettings() {
+  Settings settings;
+  prefs.begin(PREFS_NAMESPACE, true);
+  size_t length = prefs.getBytes("settings", &settings, sizeof(settings));
+  prefs.end();
+
+  if (length != sizeof(settings) || settings.magic != SETTINGS_MAGIC ||
+      settings.version != SETTINGS_VERSION || settings.alarmCount > MAX_ALARMS ||
+      settings.crc != crc32((const uint8_t*)&settings, offsetof(Settings, crc))) {
+    Serial.println("No valid saved settings, using defaults");
+    captureSettings(savedSettings);
+    return;
+  }
+
+  if (settings.timeZoneIndex >= 0 && settings.timeZoneIndex < timeZoneCount) {
+    timeZoneIndex = settings.timeZoneIndex;
+  }
+  theta_offset = settings.thetaOffset;
+  T_med = settings.tMed;
+  controlFactor = settings.controlFactor;
+  samplingInterval = settings.samplingInterval;
+  sendingInterval = settings.sendingInterval;
+  setTaskPeriod(TASK_LIGHT_SAMPLE, samplingInterval);
+  setTaskPeriod(TASK_LIGHT_SEND, sendingInterval);
+
+  alarmCount = settings.alarmCount;
+  for (int i = 0; i < alarmCount; i++) {
+    alarms[i].id = settings.alarms[i].id;
+    alarms[i].hour = settings.alarms[i].hour;
+    alarms[i].minute = settings.alarms[i].minute;
+    alarms[i].days = settings.alarms[i].days;
+    alarms[i].snoozed = false;
+  }
+  rescheduleAllAlarms();
+  savedSettings = settings;
+
+  Serial.print("Restored settings, ");
+  Serial.print(alarmCount);
+  Serial.println(" alarms");
+}
+
+void captureSettings(Settings& settings) {
+  memset(&settings, 0, sizeof(settings));  // Unused alarm slots and padding must compare equal
+  settings.magic = SETTINGS_MAGIC;
+  settings.version = SETTINGS_VERSION;
+  settings.timeZoneIndex = timeZoneIndex;
+  settings.thetaOffset = theta_offset;
+  settings.tMed = T_med;
+  settings.controlFactor = controlFactor;
+  settings.samplingInterval = samplingInterval;
+  settings.sendingInterval = sendingInterval;
+  settings.alarmCount = alarmCount;
+  for (int i = 0; i < alarmCount; i++) {
+    settings.alarms[i] = {alarms[i].id, alarms[i].hour, alarms[i].minute, alarms[i].days};
+  }
+  settings.crc = crc32((const uint8_t*)&settings, offsetof(Settings, crc));
+}
+
+void markSettingsDirty() {
+  settingsDirty = true;
+  settingsDirtySince = halMillis();
+}
+
+// Scheduler task: commits a burst of edits as a single NVS write
+void saveSettings() {
+  if (!settingsDirty || halMillis() - settingsDirtySince < SETTINGS_SAVE_DELAY) return;
+  settingsDirty = false;
+
+  Settings settings;
+  captureSettings(settings);
+  if (memcmp(&settings, &savedSettings, sizeof(settings)) == 0) return;
+
+  prefs.begin(PREFS_NAMESPACE, false);
+  prefs.putBytes("settings", &settings, sizeof(settings));
+  prefs.end();
+  savedSettings = settings;
+  Serial.println("Settings saved");
+}
+
+void displayWelcome() {
   display.setTextSize(2);
-  display.setCursor(0, 15);
+  display.setCursor(0, 10);
+  display.println("  MEDIBOX");
+  display.setTextSize(1);
+  display.setCursor(0, 35);
+  display.println("Press RIGHT to begin");
+}
+
+// One combined DHT transaction per sample, at no more than the sensor's legal rate.
+// Failed reads keep the previous snapshot.
+void acquireEnvironment() {
+  HalEnvironment reading;
+  if (!halReadEnvironment(reading)) {
+    Serial.print("DHT read failed: ");
+    Serial.println(reading.error);
+    return;
+  }
+
+  envSnapshot.temperature = reading.temperature;
+  envSnapshot.humidity = reading.humidity;
+  envSnapshot.timestamp = halMillis();
+  envSnapshot.valid = true;
+  checkEnvironment();
+  updateExcursionAnalytics();
+#if ADAPTIVE_SAMPLING
+  updateSamplingRates();
+#endif
+}
+
+#if ADAPTIVE_SAMPLING
+// Sets the DHT and light sampling periods from how close and how fast the
+// readings are moving towards a limit
+void updateSamplingRates() {
+  updateEnvironmentTrend(envTrend, envSnapshot.temperature, envSnapshot.humidity, halMillis());
+  float risk = environmentRisk(envSnapshot.temperature, envSnapshot.humidity, envTrend);
+
+  unsigned long envPeriod = sampleInterval(risk, tasks[TASK_ENVIRONMENT].period,
+                                           envFastInterval, ENV_SLOW_INTERVAL);
+  if (envPeriod != tasks[TASK_ENVIRONMENT].period) {
+    Serial.print("Environment sampled every ");
+    Serial.print(envPeriod);
+    Serial.print(" ms, risk ");
+    Serial.println(risk, 2);
+    setTaskPeriod(TASK_ENVIRONMENT, envPeriod);
+  }
+  setTaskPeriod(TASK_LIGHT_SAMPLE, sampleInterval(risk, tasks[TASK_LIGHT_SAMPLE].period,
+                                                  samplingInterval, samplingInterval * LIGHT_SLOW_FACTOR));
+}
+
+// Publishes each reading on its own for the first EXCURSION_BURST_SAMPLES of
+// an excursion instead of waiting for the batch
+void sendExcursionBurst() {
+  if (burstSamplesLeft == 0) return;
+  burstSamplesLeft--;
+  recordTelemetrySample();
+  flushTelemetry();
+}
+#endif
+
+void resetRunningStats(RunningStats& stats) {
+  stats.count = 0;
+  stats.mean = 0;
+  stats.m2 = 0;
+  stats.min = INFINITY;
+  stats.max = -INFINITY;
+}
+
+void updateRunningStats(RunningStats& stats, float value) {
+  stats.count++;
+  float delta = value - stats.mean;
+  stats.mean += delta / stats.count;
+  stats.m2 += delta * (value - stats.mean);
+  if (value < stats.min) stats.min = value;
+  if (value > stats.max) stats.max = value;
+}
+
+void resetExcursionWindow() {
+  resetRunningStats(excursionWindow.temperature);
+  resetRunningStats(excursionWindow.humidity);
+  excursionWindow.startEpoch = currentUtcEpoch();
+  excursionWindow.startTime = halMillis();
+  excursionWindow.lastSampleTime = 0;
+  excursionWindow.mktSum = 0;
+  excursionWindow.weightedTime = 0;
+  excursionWindow.tempAboveMs = 0;
+  excursionWindow.tempBelowMs = 0;
+  excursionWindow.humidityAboveMs = 0;
+  excursionWindow.humidityBelowMs = 0;
+}
+
+// Folds the latest snapshot into the current window; constant work per sample
+void updateExcursionAnalytics() {
+  ExcursionWindow& w = excursionWindow;
+  unsigned long now = envSnapshot.timestamp;
+  float temperature = envSnapshot.temperature;
+  float humidity = envSnapshot.humidity;
+
+  if (w.startTime == 0) resetExcursionWindow();
+
+  // The interval since the previous reading is credited to that reading's state
+  if (w.lastSampleTime != 0) {
+    unsigned long dt = now - w.lastSampleTime;
+    w.mktSum += dt * exp(-MKT_ACTIVATION / (w.lastTemperature + 273.15f));
+    w.weightedTime += dt;
+    if (w.lastTemperature > MAX_TEMP) w.tempAboveMs += dt;
+    if (w.lastTemperature < MIN_TEMP) w.tempBelowMs += dt;
+    if (w.lastHumidity > MAX_HUMIDITY) w.humidityAboveMs += dt;
+    if (w.lastHumidity < MIN_HUMIDITY) w.humidityBelowMs += dt;
+  }
+
+  updateRunningStats(w.temperature, temperature);
+  updateRunningStats(w.humidity, humidity);
+  w.lastTemperature = temperature;
+  w.lastHumidity = humidity;
+  w.lastSampleTime = now;
+
+  if (now - w.startTime >= EXCURSION_WINDOW) {
+    publishExcursionSummary();
+    // Carry the last reading over so the next window's first interval is counted
+    resetExcursionWindow();
+    w.lastTemperature = temperature;
+    w.lastHumidity = humidity;
+    w.lastSampleTime = now;
+  }
+}
+
+void publishExcursionSummary() {
+  const ExcursionWindow& w = excursionWindow;
+  if (w.temperature.count == 0) return;
+
+  // MKT = (dH/R) / -ln(mean of exp(-dH/RT)), converted back to degC
+  float mkt = w.lastTemperature;
+  if (w.weightedTime > 0) {
+    mkt = MKT_ACTIVATION / -log(w.mktSum / w.weightedTime) - 273.15f;
+  }
+
+  ExcursionSummary summary;
+  summary.version = TELEMETRY_SCHEMA_VERSION;
+  summary.startEpoch = w.startEpoch;
+  summary.duration = (halMillis() - w.startTime) / 1000;
+  summary.samples = (uint16_t)min(w.temperature.count, (uint32_t)UINT16_MAX);
+  summary.tempMin = (int16_t)lroundf(w.temperature.min * 100);
+  summary.tempMax = (int16_t)lroundf(w.temperature.max * 100);
+  summary.tempMean = (int16_t)lroundf(w.temperature.mean * 100);
+  summary.tempStdDev = (int16_t)lroundf(sqrtf(w.temperature.m2 / w.temperature.count) * 100);
+  summary.humMin = (uint16_t)lroundf(w.humidity.min * 100);
+  summary.humMax = (uint16_t)lroundf(w.humidity.max * 100);
+  summary.humMean = (uint16_t)lroundf(w.humidity.mean * 100);
+  summary.humStdDev = (uint16_t)lroundf(sqrtf(w.humidity.m2 / w.humidity.count) * 100);
+  summary.meanKineticTemp = (int16_t)lroundf(mkt * 100);
+  summary.tempAbove = w.tempAboveMs / 1000;
+  summary.tempBelow = w.tempBelowMs / 1000;
+  summary.humAbove = w.humidityAboveMs / 1000;
+  summary.humBelow = w.humidityBelowMs / 1000;
+
+  publishMessage(env_summary_topic, (const uint8_t*)&summary, sizeof(summary));
+
+  Serial.print("Excursion summary: MKT ");
+  Serial.print(mkt);
+  Serial.print(" C, ");
+  Serial.print(summary.tempAbove + summary.tempBelow);
+  Serial.println(" s out of temperature range");
+}
+
+void checkEnvironment() {
+  float temperature = envSnapshot.temperature;
+  float humidity = envSnapshot.humidity;
+#if TELEMETRY_REPORT_BY_EXCEPTION || ADAPTIVE_SAMPLING
+  bool wasWarning = envWarning;
+#endif
   
-  // Find which alarm is triggered
-  for (int i = 0; i < 2; i++) {
-    if (alarms[i].ringing) {
-      display.print("ALARM ");
-      display.println(i+1);
-      currentAlarmIndex = i;
-      break;
-    }
+  // Check if values are within limits
+  envWarning = environmentOutOfRange(temperature, humidity);
+
+#if ADAPTIVE_SAMPLING
+  if (envWarning && !wasWarning) burstSamplesLeft = EXCURSION_BURST_SAMPLES;
+  sendExcursionBurst();
+#endif
+#if TELEMETRY_REPORT_BY_EXCEPTION
+  // Excursions starting or ending go out immediately (a start already went out in the burst)
+  if (envWarning != wasWarning && !(ADAPTIVE_SAMPLING && envWarning)) {
+    recordTelemetrySample();
+    checkReportByException(true);
   }
+#endif
+  
+  updateSignals();
+}
+
+void setupSignals() {
+  ledcAttach(BUZZER_PIN, SIGNAL_FREQUENCY, SIGNAL_RESOLUTION);
+  ledcAttach(LED_PIN, SIGNAL_FREQUENCY, SIGNAL_RESOLUTION);
+  halWriteSignal(BUZZER_PIN, 0);
+  halWriteSignal(LED_PIN, 0);
+  updateSignals();
+}
+
+// Picks each output's pattern by priority: dose alarm > environment warning > idle.
+// Called on every state change; the scheduler task is only a backstop.
+void updateSignals() {
+  SignalPattern buzzer = SIGNAL_OFF;
+  SignalPattern led = SIGNAL_SOLID;
+
+  if (alarmTriggered) {
+    buzzer = SIGNAL_BLINK;
+  } else if (envWarning) {
+    buzzer = SIGNAL_SOLID;
+  }
+  if (envWarning) {
+    led = SIGNAL_BLINK;
+  }
+
+  setSignal(BUZZER_PIN, buzzerPattern, buzzer);
+  setSignal(LED_PIN, ledPattern, led);
+}
+
+void setSignal(uint8_t pin, SignalPattern& current, SignalPattern pattern) {
+  if (pattern == current) return;
+  current = pattern;
+  switch (pattern) {
+    case SIGNAL_OFF:   halWriteSignal(pin, 0); break;
+    case SIGNAL_BLINK: halWriteSignal(pin, SIGNAL_DUTY_FULL / 2); break;
+    case SIGNAL_SOLID: halWriteSignal(pin, SIGNAL_DUTY_FULL); break;
+  }
+}
+
+void displayTime() {
+  // Display time (large)
+  display.setTextSize(2);
+  display.setCursor(0, 10);
+  display.println(clockCache.time);
   
+  // Display date (medium)
   display.setTextSize(1);
   display.setCursor(0, 35);
-  display.println("RIGHT: Stop Alarm");
-  display.setCursor(0, 45);
-  display.println("DOWN: Snooze (2min)");
+  display.println(clockCache.date);
+  
+  // Display environmental data
+  display.setCursor(0, 50);
+  display.print(envSnapshot.temperature, 1);
+  display.print("C ");
+  display.print(envSnapshot.humidity, 0);
+  display.print("%");
+  
+  // Show warning indicator if needed
+  if (envWarning) {
+    display.setCursor(110, 50);
+    display.print("!");
+    
+    // Display warning message
+    display.setCursor(0, 0);
+    printEnvironmentWarning(display, envSnapshot.temperature, envSnapshot.humidity);
+  }
   
-  display.display();
+  // Next dose time
+  if (alarmCount > 0) {
+    time_t due = alarms[0].nextDue;
+    struct tm dueLocal;
+    localtime_r(&due, &dueLocal);
+    char next[6];
+    sprintf(next, "%02d:%02d", dueLocal.tm_hour, dueLocal.tm_min);
+    display.setCursor(98, 20);
+    display.print(next);
+  }
+}
+
+void checkAlarms() {
+  if (alarmTriggered || !clockCache.valid) return;
+
+  int missedId;
+  int index = dueAlarm(currentUtcEpoch(), missedId);
+  if (missedId) {
+    Serial.print("Missed alarm ");
+    Serial.println(missedId);
+  }
+  if (index < 0) return;
+  alarmTriggered = true;
+  ringingAlarmId = alarms[index].id;
+  currentState = ALARM_TRIGGERED;
+  updateSignals();
 }
 
 void stopAlarm() {
-  digitalWrite(BUZZER_PIN, LOW);
   alarmTriggered = false;
-  
-  // Turn off all ringing alarms
-  for (int i = 0; i < 2; i++) {
-    alarms[i].ringing = false;
-    alarms[i].snoozed = false;
-  }
+  updateSignals();
+
+  int index = findAlarm(ringingAlarmId);
+  if (index >= 0) rearmAlarm(index, currentUtcEpoch());
+  ringingAlarmId = 0;
   
   currentState = SHOW_TIME;
 }
 
 void snoozeAlarm() {
-  digitalWrite(BUZZER_PIN, LOW);
   alarmTriggered = false;
+  updateSignals();
   
-  // Set snooze state
-  alarms[currentAlarmIndex].ringing = false;
-  alarms[currentAlarmIndex].snoozed = true;
-  alarms[currentAlarmIndex].snoozeStartTime = millis();
+  // Ring again after the snooze period without touching the alarm's schedule
+  int index = findAlarm(ringingAlarmId);
+  if (index >= 0) snoozeAlarmUntil(index, currentUtcEpoch() + SNOOZE_DURATION / 1000);
+  ringingAlarmId = 0;
   
   currentState = SHOW_TIME;
 }
 
-String getDayOfWeek(int day) {
-  switch(day) {
-    case 0: return "Sun";
-    case 1: return "Mon";
-    case 2: return "Tue";
-    case 3: return "Wed";
-    case 4: return "Thu";
-    case 5: return "Fri";
-    case 6: return "Sat";
-    default: return "";
+uint32_t currentUtcEpoch() {
+  return (uint32_t)halTime();
+}
+
+// Returns the new alarm's id, the id of an identical alarm already in the table,
+// or 0 if the table is full. alarms/set is QoS 1 and may be retained, so a
+// redelivered message must not add a second copy.
+int addAlarm(int hour, int minute, int days) {
+  int existing = findMatchingAlarm(hour, minute, days);
+  if (existing >= 0) return alarms[existing].id;
+
+  int id = freeAlarmId();
+  if (id == 0) {
+    Serial.println("Alarm table full");
+    return 0;
   }
+
+  int index = insertAlarm(id, hour, minute, days, currentUtcEpoch());
+  markSettingsDirty();
+  publishAlarmStatus("added", alarms[index]);
+  return id;
+}
+
+bool deleteAlarm(int id) {
+  int index = findAlarm(id);
+  if (index < 0) return false;
+
+  if (alarmTriggered && id == ringingAlarmId) stopAlarm();
+  index = findAlarm(id);  // stopAlarm() may have moved it
+  Alarm removed = alarms[index];
+  removeAlarm(index);
+  markSettingsDirty();
+
+  // Keep the list cursor on a valid row
+  if (viewAlarmsSelection >= alarmCount) viewAlarmsSelection = max(alarmCount - 1, 0);
+  if (viewAlarmsScroll > viewAlarmsSelection) viewAlarmsScroll = viewAlarmsSelection;
+
+  publishAlarmStatus("deleted", removed);
+  return true;
+}
+
+// Needed whenever the clock or time zone changes under the table
+void rescheduleAllAlarms() {
+  // Ringing and snoozed alarms already hold an absolute deadline
+  rescheduleAlarms(currentUtcEpoch(), alarmTriggered ? ringingAlarmId : 0);
+}
+
+// "<event>,<id>,HH:MM,<weekday mask>"
+void publishAlarmStatus(const char* event, const Alarm& alarm) {
+  char status[32];
+  int length = snprintf(status, sizeof(status), "%s,%d,%02d:%02d,%d",
+                        event, alarm.id, alarm.hour, alarm.minute, alarm.days);
+  publishMessage(alarm_status_topic, (const uint8_t*)status, length);
 }
 
 void handleButtons() {
-  if (btnRightPressed) {
-    btnRightPressed = false;
-    handleRightButton();
+  bool handled = false;
+
+  ButtonEvent event;
+  while (buttonEventQueue.pop(event)) {
+    handled |= handleButtonEvent(event);
   }
-  if (btnLeftPressed) {
-    btnLeftPressed = false;
-    handleLeftButton();
+
+#if TRACE_MODE != TRACE_REPLAY  // Replayed buttons exist only as their recorded edges
+  // Edges dropped inside the debounce window turn up once the pin settles
+  for (uint8_t button = 0; button < BUTTON_COUNT; button++) {
+    if (settleButton(button, buttonPins[button], event)) handled |= handleButtonEvent(event);
   }
-  if (btnUpPressed) {
-    btnUpPressed = false;
-    handleUpButton();
+#endif
+
+  // Long press on UP/DOWN auto-repeats while a value is being set
+  unsigned long now = halMillis();
+#if LOW_POWER_MODE
+  if (wakeFilter && (long)(now - wokenAt) >= 0) wakeFilter = false;
+#endif
+  for (uint8_t button = 0; button < BUTTON_COUNT; button++) {
+    ButtonState& state = buttonStates[button];
+    if (!state.held) continue;
+    if ((button == BUTTON_UP || button == BUTTON_DOWN) && isRepeatState() &&
+        now - state.pressedAt >= LONG_PRESS_TIME &&
+        now - state.lastRepeat >= REPEAT_INTERVAL) {
+      state.lastRepeat = now;
+      dispatchButton(button);
+      handled = true;
+    }
   }
-  if (btnDownPressed) {
-    btnDownPressed = false;
-    handleDownButton();
+
+  // Redraw straight away instead of waiting for the next display period
+  if (handled) {
+    runTaskNow(TASK_DISPLAY);
   }
 }
 
-void handleRightButton() {
-  switch(currentState) {
-    case WELCOME:
-      currentState = SHOW_TIME;
-      break;
-    case SHOW_TIME:
-      currentState = MAIN_MENU;
-      menuOption = 0;
-      break;
-    case MAIN_MENU:
-      if (menuOption == 0) {
-        currentAlarmIndex = 0;
-        currentState = SET_ALARM_HOUR;
-      } else if (menuOption == 1) {
-        currentAlarmIndex = 1;
-        currentState = SET_ALARM_HOUR;
-      } else if (menuOption == 2) {
-        currentState = SET_TIMEZONE;
-      } else if (menuOption == 3) {
-        viewAlarmsSelection = 0;
-        currentState = VIEW_ALARMS;
-      }
-      break;
-    case SET_ALARM_HOUR:
-      currentState = SET_ALARM_MINUTE;
-      break;
-    case SET_ALARM_MINUTE:
-      alarms[currentAlarmIndex].active = true;
-      currentState = MAIN_MENU;
-      break;
-    case SET_TIMEZONE:
-      currentState = MAIN_MENU;
-      break;
-    case VIEW_ALARMS:
-      if (alarms[viewAlarmsSelection].active) {
-        currentState = CONFIRM_DELETE;
-      }
-      break;
-    case CONFIRM_DELETE:
-      alarms[viewAlarmsSelection].active = false;
-      alarms[viewAlarmsSelection].ringing = false;
-      alarms[viewAlarmsSelection].snoozed = false;
-      currentState = VIEW_ALARMS;
-      break;
-    case ALARM_TRIGGERED:
-      stopAlarm();
-      break;
-    default:
-      currentState = MAIN_MENU;
+// Returns true when the event changed the screen
+bool handleButtonEvent(const ButtonEvent& event) {
+#if TRACE_MODE == TRACE_RECORD
+  uint8_t record[2] = {event.button, event.edge};
+  traceRecord(TRACE_BUTTON, record, sizeof(record), event.time);
+#endif
+  ButtonState& state = buttonStates[event.button];
+  if (event.edge != EDGE_PRESS) {
+    state.held = false;
+    return false;
   }
+#if LOW_POWER_MODE
+  // The buttons task keeps running (slowly) while idle, so a press on a blank
+  // screen only wakes it, and presses queued alongside it are stale
+  if (noteUserActivity() || (wakeFilter && (long)(event.time - wokenAt) < 0)) return false;
+#endif
+  state.held = true;
+  state.pressedAt = event.time;
+  state.lastRepeat = event.time;
+  dispatchButton(event.button);
+  return true;
 }
 
-void handleLeftButton() {
-  if (currentState == SHOW_TIME) {
-    currentState = WELCOME;
-  } else if (currentState == MAIN_MENU || currentState == VIEW_ALARMS || currentState == CONFIRM_DELETE) {
-    currentState = SHOW_TIME;
-  } else if (currentState == SET_ALARM_HOUR || currentState == SET_ALARM_MINUTE || currentState == SET_TIMEZONE) {
-    currentState = MAIN_MENU;
+// What a button does on a screen: run the action (if any), then move to next unless
+// the action returned false
+struct Transition {
+  bool (*action)();
+  int next;  // AppState, or STAY
+};
+
+struct Screen {
+  void (*render)();
+  bool repeat;                          // Holding UP/DOWN auto-repeats
+  Transition on[BUTTON_COUNT];          // Indexed by ButtonId: UP, LEFT, DOWN, RIGHT
+};
+
+// Order must match AppState
+constexpr Screen screens[STATE_COUNT] = {
+  // WELCOME
+  {displayWelcome, false, {{NULL, STAY}, {NULL, STAY}, {NULL, STAY}, {NULL, SHOW_TIME}}},
+  // SHOW_TIME
+  {displayTime, false, {{NULL, STAY}, {NULL, WELCOME}, {NULL, STAY}, {openMenu, MAIN_MENU}}},
+  // MAIN_MENU
+  {displayMenu, false, {{menuPrevious, STAY}, {NULL, SHOW_TIME}, {menuNext, STAY}, {selectMenuItem, STAY}}},
+  // SET_ALARM_HOUR
+  {displaySetAlarmHour, true, {{draftHourUp, STAY}, {NULL, MAIN_MENU}, {draftHourDown, STAY}, {NULL, SET_ALARM_MINUTE}}},
+  // SET_ALARM_MINUTE
+  {displaySetAlarmMinute, true, {{draftMinuteUp, STAY}, {NULL, MAIN_MENU}, {draftMinuteDown, STAY}, {saveDraftAlarm, MAIN_MENU}}},
+  // SET_TIMEZONE
+  {displaySetTimezone, true, {{timeZoneNext, STAY}, {NULL, MAIN_MENU}, {timeZonePrevious, STAY}, {NULL, MAIN_MENU}}},
+  // VIEW_ALARMS
+  {displayViewAlarms, false, {{alarmsPrevious, STAY}, {NULL, SHOW_TIME}, {alarmsNext, STAY}, {beginDelete, CONFIRM_DELETE}}},
+  // ALARM_TRIGGERED (RIGHT/DOWN normally go straight from the ISR to the alarm control path)
+  {displayAlarmScreen, false, {{NULL, STAY}, {NULL, STAY}, {NULL, STAY}, {stopRingingAlarm, STAY}}},
+  // CONFIRM_DELETE
+  {displayConfirmDelete, false, {{confirmDelete, VIEW_ALARMS}, {NULL, SHOW_TIME}, {NULL, VIEW_ALARMS}, {confirmDelete, VIEW_ALARMS}}},
+};
+
+// Main menu entries: label, the screen it opens and what to reset on the way in
+struct MenuItem {
+  const char* label;
+  AppState target;
+  bool (*enter)();
+};
+
+constexpr MenuItem menuItems[] = {
+  {"Add Alarm",    SET_ALARM_HOUR, beginNewAlarm},
+  {"Set Timezone", SET_TIMEZONE,   NULL},
+  {"View Alarms",  VIEW_ALARMS,    beginViewAlarms},
+};
+constexpr int menuItemCount = sizeof(menuItems) / sizeof(menuItems[0]);
+
+void dispatchButton(uint8_t button) {
+  const Transition& transition = screens[currentState].on[button];
+  if (transition.action != NULL && !transition.action()) return;
+  if (transition.next != STAY) currentState = (AppState)transition.next;
+}
+
+bool isRepeatState() {
+  return screens[currentState].repeat;
+}
+
+// Steps value by delta, wrapping within [0, count)
+int wrapStep(int value, int delta, int count) {
+  return (value + delta + count) % count;
+}
+
+bool openMenu() {
+  menuOption = 0;
+  return true;
+}
+
+bool selectMenuItem() {
+  const MenuItem& item = menuItems[menuOption];
+  if (item.enter != NULL) item.enter();
+  currentState = item.target;
+  return true;
+}
+
+bool menuPrevious() {
+  menuOption = wrapStep(menuOption, -1, menuItemCount);
+  return true;
+}
+
+bool menuNext() {
+  menuOption = wrapStep(menuOption, 1, menuItemCount);
+  return true;
+}
+
+bool beginNewAlarm() {
+  draftHour = 0;
+  draftMinute = 0;
+  return true;
+}
+
+bool beginViewAlarms() {
+  viewAlarmsSelection = 0;
+  viewAlarmsScroll = 0;
+  return true;
+}
+
+bool draftHourUp() {
+  draftHour = wrapStep(draftHour, 1, 24);
+  return true;
+}
+
+bool draftHourDown() {
+  draftHour = wrapStep(draftHour, -1, 24);
+  return true;
+}
+
+bool draftMinuteUp() {
+  draftMinute = wrapStep(draftMinute, 1, 60);
+  return true;
+}
+
+bool draftMinuteDown() {
+  draftMinute = wrapStep(draftMinute, -1, 60);
+  return true;
+}
+
+bool saveDraftAlarm() {
+  addAlarm(draftHour, draftMinute, ALARM_EVERY_DAY);
+  return true;
+}
+
+bool timeZoneNext() {
+  timeZoneIndex = wrapStep(timeZoneIndex, 1, timeZoneCount);
+  updateTimeZone();
+  return true;
+}
+
+bool timeZonePrevious() {
+  timeZoneIndex = wrapStep(timeZoneIndex, -1, timeZoneCount);
+  updateTimeZone();
+  return true;
+}
+
+bool alarmsPrevious() {
+  if (alarmCount == 0) return false;
+  viewAlarmsSelection = wrapStep(viewAlarmsSelection, -1, alarmCount);
+  if (viewAlarmsSelection < viewAlarmsScroll) viewAlarmsScroll = viewAlarmsSelection;
+  if (viewAlarmsSelection >= viewAlarmsScroll + VIEW_ALARM_ROWS) {
+    viewAlarmsScroll = viewAlarmsSelection - VIEW_ALARM_ROWS + 1;  // Wrapped to the end
   }
+  return true;
 }
 
-void handleUpButton() {
-  switch(currentState) {
-    case SET_ALARM_HOUR:
-      alarms[currentAlarmIndex].hour = (alarms[currentAlarmIndex].hour + 1) % 24;
-      break;
-    case SET_ALARM_MINUTE:
-      alarms[currentAlarmIndex].minute = (alarms[currentAlarmIndex].minute + 1) % 60;
-      break;
-    case SET_TIMEZONE:
-      timeZoneOffset += 1800; // 30 minutes
-      if (timeZoneOffset > 86400) timeZoneOffset -= 86400;
-      updateTimeZone();
-      break;
-    case MAIN_MENU:
-      menuOption = (menuOption - 1 + menuItemCount) % menuItemCount;
-      break;
-    case VIEW_ALARMS:
-      viewAlarmsSelection = (viewAlarmsSelection - 1 + 2) % 2;
-      break;
-    case CONFIRM_DELETE:
-      alarms[viewAlarmsSelection].active = false;
-      alarms[viewAlarmsSelection].ringing = false;
-      alarms[viewAlarmsSelection].snoozed = false;
-      currentState = VIEW_ALARMS;
-      break;
+bool alarmsNext() {
+  if (alarmCount == 0) return false;
+  viewAlarmsSelection = wrapStep(viewAlarmsSelection, 1, alarmCount);
+  if (viewAlarmsSelection >= viewAlarmsScroll + VIEW_ALARM_ROWS) {
+    viewAlarmsScroll = viewAlarmsSelection - VIEW_ALARM_ROWS + 1;
   }
+  if (viewAlarmsSelection < viewAlarmsScroll) viewAlarmsScroll = viewAlarmsSelection;  // Wrapped to the top
+  return true;
 }
 
-void handleDownButton() {
-  switch(currentState) {
-    case SET_ALARM_HOUR:
-      alarms[currentAlarmIndex].hour = (alarms[currentAlarmIndex].hour - 1 + 24) % 24;
-      break;
-    case SET_ALARM_MINUTE:
-      alarms[currentAlarmIndex].minute = (alarms[currentAlarmIndex].minute - 1 + 60) % 60;
-      break;
-    case SET_TIMEZONE:
-      timeZoneOffset -= 1800; // 30 minutes
-      if (timeZoneOffset < -86400) timeZoneOffset += 86400;
-      updateTimeZone();
-      break;
-    case MAIN_MENU:
-      menuOption = (menuOption + 1) % menuItemCount;
-      break;
-    case VIEW_ALARMS:
-      viewAlarmsSelection = (viewAlarmsSelection + 1) % 2;
-      break;
-    case CONFIRM_DELETE:
-      currentState = VIEW_ALARMS;
-      break;
+// Nothing to confirm on an empty list
+bool beginDelete() {
+  if (alarmCount == 0) return false;
+  deleteAlarmId = alarms[viewAlarmsSelection].id;
+  return true;
+}
+
+bool confirmDelete() {
+  deleteAlarm(deleteAlarmId);
+  return true;
+}
+
+bool stopRingingAlarm() {
+  stopAlarm();
+  return true;
+}
+
+void captureScreenInputs(ScreenInputs& inputs) {
+  memset(&inputs, 0, sizeof(inputs));  // Zero padding so memcmp is meaningful
+  inputs.state = currentState;
+  inputs.menuOption = menuOption;
+  inputs.ringingAlarmId = ringingAlarmId;
+  inputs.viewSelection = viewAlarmsSelection;
+  inputs.viewScroll = viewAlarmsScroll;
+  inputs.deleteAlarmId = deleteAlarmId;
+  inputs.draftHour = draftHour;
+  inputs.draftMinute = draftMinute;
+  inputs.alarmRevision = alarmRevision;
+  inputs.timeZoneIndex = timeZoneIndex;
+  if (currentState == SHOW_TIME || currentState == ALARM_TRIGGERED || currentState == SET_TIMEZONE) {
+    inputs.epoch = clockCache.epoch;
   }
+  inputs.temperatureTenths = (int)lroundf(envSnapshot.temperature * 10);
+  inputs.humidityPercent = (int)lroundf(envSnapshot.humidity);
+  inputs.envWarning = envWarning;
 }
 
-void updateDisplay() {
-  display.clearDisplay();
-  display.setTextSize(1);
-  display.setTextColor(SSD1306_WHITE);
+// Forces the next updateDisplay() to render even if no tracked input changed
+void requestRedraw() {
+  redrawRequested = true;
+}
 
-  // Handle ALARM_TRIGGERED state separately
+void updateDisplay() {
+#if LOW_POWER_MODE
+  // Blank after inactivity; a ringing alarm always turns the screen back on
   if (currentState == ALARM_TRIGGERED) {
-    // Show current time at top
-    display.setTextSize(1);
-    display.setCursor(0, 0);
-    String formattedTime = timeClient.getFormattedTime();
-    display.println(formattedTime);
-    
-    // Show environmental data
-    display.setCursor(70, 0);
-    display.print(temperature, 1);
-    display.print("C ");
-    display.print(humidity, 0);
-    display.print("%");
-    
-    // Show alarm message
-    display.setTextSize(2);
-    display.setCursor(0, 15);
-    
-    // Find which alarm is triggered
-    for (int i = 0; i < 2; i++) {
-      if (alarms[i].ringing) {
-        display.print("ALARM ");
-        display.println(i+1);
-        currentAlarmIndex = i;
-        break;
-      }
-    }
-    
-    display.setTextSize(1);
-    display.setCursor(0, 35);
-    display.println("RIGHT: Stop Alarm");
-    display.setCursor(0, 45);
-    display.println("DOWN: Snooze (2min)");
-    
-    display.display();
-    return;
+    lastUserActivity = halMillis();
+    if (displayBlanked) setDisplayPower(true);
+  } else if (!displayBlanked && halMillis() - lastUserActivity >= DISPLAY_TIMEOUT) {
+    setDisplayPower(false);
   }
+  if (displayBlanked) return;
+#endif
 
-  // Handle all other states
-  switch(currentState) {
-    case WELCOME:
-      displayWelcome();
-      break;
-    case SHOW_TIME:
-      displayTime();
-      break;
-    case MAIN_MENU:
-      displayMenu();
-      break;
-    case SET_ALARM_HOUR:
-      displaySetAlarmHour();
-      break;
-    case SET_ALARM_MINUTE:
-      displaySetAlarmMinute();
-      break;
-    case SET_TIMEZONE:
-      displaySetTimezone();
-      break;
-    case VIEW_ALARMS:
-      displayViewAlarms();
-      break;
-    case CONFIRM_DELETE:
-      displayConfirmDelete();
-      break;
+  // Only render when something on screen would actually change
+  ScreenInputs inputs;
+  captureScreenInputs(inputs);
+  if (!redrawRequested && memcmp(&inputs, &lastScreenInputs, sizeof(inputs)) == 0) {
+    return;
   }
-  
-  display.display();
+  lastScreenInputs = inputs;
+  redrawRequested = false;
+
+  display.clearDisplay();
+  display.setTextSize(1);
+  display.setTextColor(SSD1306_WHITE);
+  screens[currentState].render();
+  flushDisplay(display, OLED_ADDR);
 }
 
 void displayMenu() {
-  display.clearDisplay();
   display.setTextSize(1);
   display.setCursor(0, 0);
   display.println("Main Menu:");
@@ -862,7 +2922,7 @@ void displayMenu() {
     } else {
       display.print("  ");
     }
-    display.println(menuItems[i]);
+    display.println(menuItems[i].label);
   }
   
   // Display instructions
@@ -871,17 +2931,14 @@ void displayMenu() {
 }
 
 void displaySetAlarmHour() {
-  display.clearDisplay();
   display.setTextSize(1);
   display.setCursor(0, 0);
-  display.print("Set Alarm ");
-  display.print(currentAlarmIndex + 1);
-  display.println(" Hour:");
+  display.println("New Alarm Hour:");
   
   display.setTextSize(2);
   display.setCursor(40, 25);
-  if (alarms[currentAlarmIndex].hour < 10) display.print("0");
-  display.print(alarms[currentAlarmIndex].hour);
+  if (draftHour < 10) display.print("0");
+  display.print(draftHour);
   
   display.setTextSize(1);
   display.setCursor(0, 55);
@@ -889,17 +2946,14 @@ void displaySetAlarmHour() {
 }
 
 void displaySetAlarmMinute() {
-  display.clearDisplay();
   display.setTextSize(1);
   display.setCursor(0, 0);
-  display.print("Set Alarm ");
-  display.print(currentAlarmIndex + 1);
-  display.println(" Minute:");
+  display.println("New Alarm Minute:");
   
   display.setTextSize(2);
   display.setCursor(40, 25);
-  if (alarms[currentAlarmIndex].minute < 10) display.print("0");
-  display.print(alarms[currentAlarmIndex].minute);
+  if (draftMinute < 10) display.print("0");
+  display.print(draftMinute);
   
   display.setTextSize(1);
   display.setCursor(0, 55);
@@ -907,66 +2961,67 @@ void displaySetAlarmMinute() {
 }
 
 void displaySetTimezone() {
-  display.clearDisplay();
   display.setTextSize(1);
   display.setCursor(0, 0);
-  display.println("Set Timezone Offset");
+  display.println("Set Timezone");
   
-  display.setCursor(0, 20);
-  display.print("UTC");
-  if (timeZoneOffset >= 0) display.print("+");
-  display.print(timeZoneOffset / 3600);
-  display.print(":");
-  int minutes = abs((timeZoneOffset % 3600) / 60);
-  if (minutes < 10) display.print("0");
-  display.print(minutes);
-  
-  // Convert to HMS
-  int hours = timeZoneOffset / 3600;
-  int mins = (abs(timeZoneOffset) % 3600) / 60;
+  const char* name = timeZones[timeZoneIndex].name;
+  display.setTextSize(strlen(name) > 10 ? 1 : 2);  // Long names would wrap at size 2
+  display.setCursor(0, 15);
+  display.println(name);
   
-  display.setCursor(0, 35);
-  display.print("(");
-  if (timeZoneOffset >= 0) display.print("+");
-  display.print(hours);
-  display.print("h ");
-  if (mins < 10) display.print("0");
-  display.print(mins);
-  display.print("m)");
+  // Current offset, DST included, and the local time it gives
+  long offset = currentUtcOffset();
+  char line[22];
+  int hours = (int)(labs(offset) / 3600 % 24);  // Real zones stay within +/-14 h
+  int minutes = (int)(labs(offset) % 3600 / 60);
+  snprintf(line, sizeof(line), "UTC%c%02d:%02d  ", offset < 0 ? '-' : '+', hours, minutes);
+  display.setTextSize(1);
+  display.setCursor(0, 38);
+  display.print(line);
+  display.print(clockCache.time);
   
   // Display instructions
   display.setCursor(0, 55);
   display.println("UP/DOWN:Change RIGHT:Save");
 }
 
+// Scrolling list in due order, VIEW_ALARM_ROWS at a time
 void displayViewAlarms() {
-  display.clearDisplay();
   display.setTextSize(1);
   display.setCursor(0, 0);
-  display.println("Active Alarms:");
-  
-  for (int i = 0; i < 2; i++) {
-    display.setCursor(5, 15 + (i * 15));
-    if (i == viewAlarmsSelection) display.print("> ");
-    else display.print("  ");
-    
-    display.print("Alarm ");
-    display.print(i+1);
-    display.print(": ");
-    if (alarms[i].active) {
-      if (alarms[i].hour < 10) display.print("0");
-      display.print(alarms[i].hour);
-      display.print(":");
-      if (alarms[i].minute < 10) display.print("0");
-      display.print(alarms[i].minute);
-    } else {
-      display.print("Not set");
-    }
+  display.print("Alarms (");
+  display.print(alarmCount);
+  display.println("):");
+
+  if (alarmCount == 0) {
+    display.setCursor(5, 20);
+    display.println("None set");
+  }
+
+  for (int row = 0; row < VIEW_ALARM_ROWS; row++) {
+    int i = viewAlarmsScroll + row;
+    if (i >= alarmCount) break;
+    char line[20];
+    formatAlarm(line, alarms[i]);
+    display.setCursor(0, 12 + row * 12);
+    display.print(i == viewAlarmsSelection ? "> " : "  ");
+    display.print(line);
+  }
+
+  // Scroll position markers
+  if (viewAlarmsScroll > 0) {
+    display.setCursor(122, 12);
+    display.print("^");
+  }
+  if (viewAlarmsScroll + VIEW_ALARM_ROWS < alarmCount) {
+    display.setCursor(122, 36);
+    display.print("v");
   }
   
   // Display instructions
   display.setCursor(0, 55);
-  if (alarms[viewAlarmsSelection].active) {
+  if (alarmCount > 0) {
     display.println("LEFT:Exit RIGHT:Delete");
   } else {
     display.println("LEFT:Exit");
@@ -974,21 +3029,266 @@ void displayViewAlarms() {
 }
 
 void displayConfirmDelete() {
-  display.clearDisplay();
+  int index = findAlarm(deleteAlarmId);
+
   display.setTextSize(1);
   display.setCursor(0, 0);
-  display.print("Delete Alarm ");
-  display.print(viewAlarmsSelection + 1);
+  display.print("Delete Alarm #");
+  display.print(deleteAlarmId);
   display.println("?");
   
-  display.setCursor(0, 20);
-  display.print(alarms[viewAlarmsSelection].hour < 10 ? "0" : "");
-  display.print(alarms[viewAlarmsSelection].hour);
-  display.print(":");
-  display.print(alarms[viewAlarmsSelection].minute < 10 ? "0" : "");
-  display.println(alarms[viewAlarmsSelection].minute);
+  if (index >= 0) {
+    char line[20];
+    formatAlarm(line, alarms[index]);
+    display.setCursor(0, 20);
+    display.println(line);
+  }
   
   display.setTextSize(1);
   display.setCursor(0, 40);
   display.println("UP: Yes, DOWN: No");
 }
+
+void displayAlarmScreen() {
+  uint8_t* buffer = display.getBuffer();
+
+  // Static text only changes with the ringing alarm, so render it once and reuse it
+  if (alarmTemplateId != ringingAlarmId) {
+    display.clearDisplay();
+    display.setTextSize(2);
+    display.setCursor(0, 15);
+    display.print("ALARM #");
+    display.println(ringingAlarmId);
+
+    display.setTextSize(1);
+    display.setCursor(0, 35);
+    display.println("RIGHT: Stop Alarm");
+    display.setCursor(0, 45);
+    display.println("DOWN: Snooze (2min)");
+
+    memcpy(alarmScreenTemplate, buffer, sizeof(alarmScreenTemplate));
+    alarmTemplateId = ringingAlarmId;
+  } else {
+    memcpy(buffer, alarmScreenTemplate, sizeof(alarmScreenTemplate));
+  }
+
+  // Patch in the clock and environmental data on the top row
+  display.setTextSize(1);
+  display.setCursor(0, 0);
+  display.print(clockCache.time);
+
+  display.setCursor(70, 0);
+  display.print(envSnapshot.temperature, 1);
+  display.print("C ");
+  display.print(envSnapshot.humidity, 0);
+  display.print("%");
+}
+
+#if TRACE_MODE != TRACE_OFF
+#if TRACE_MODE == TRACE_RECORD
+// Keeps the previous boot's trace and starts a new one, stamped with the wall clock
+void setupTrace() {
+  if (!LittleFS.begin(true)) {
+    Serial.println("LittleFS mount failed, tracing off");
+    return;
+  }
+  LittleFS.remove(TRACE_PREVIOUS_PATH);
+  LittleFS.rename(TRACE_PATH, TRACE_PREVIOUS_PATH);
+  traceFile = LittleFS.open(TRACE_PATH, "w");
+  uint32_t epoch = halTime();
+  traceRecord(TRACE_CLOCK, &epoch, sizeof(epoch), halMillis());
+}
+
+// Appends one record; recording stops for good once the file reaches its cap
+void traceRecord(uint8_t type, const void* payload, uint16_t length, uint32_t time) {
+  if (!traceFile) return;
+  TraceHeader header = {time, type, length};
+  if (traceBytes + sizeof(header) + length > TRACE_MAX_BYTES) {
+    Serial.println("Trace full, recording stopped");
+    traceFile.close();
+    return;
+  }
+  traceFile.write((const uint8_t*)&header, sizeof(header));
+  traceFile.write((const uint8_t*)payload, length);
+  traceBytes += sizeof(header) + length;
+}
+
+// Bounds how much of the trace a crash can lose
+void flushTrace() {
+  if (traceFile) traceFile.flush();
+}
+#else
+// Opens the trace and starts the virtual clock at its first record
+void setupTrace() {
+  if (!LittleFS.begin(true) || !(traceFile = LittleFS.open(TRACE_PATH, "r"))) {
+    Serial.println("No trace to replay");
+    virtualMillis = millis();
+    return;
+  }
+  replayActive = readReplayRecord();
+  if (!replayActive) return;
+  virtualMillis = replayTraceStart = replayHeader.time;
+  replayStartedAt = millis();
+  replayUntil(virtualMillis);
+}
+
+// Reads the next record into replayHeader/replayPayload; false at the end of the trace
+bool readReplayRecord() {
+  if (traceFile.read((uint8_t*)&replayHeader, sizeof(replayHeader)) != sizeof(replayHeader) ||
+      replayHeader.length > TRACE_PAYLOAD_MAX ||
+      traceFile.read(replayPayload, replayHeader.length) != replayHeader.length) {
+    traceFile.close();
+    return false;
+  }
+  replayPayload[replayHeader.length] = '\0';
+  return true;
+}
+
+// Applies every record due by `time`, the same way the live input would have arrived
+void replayUntil(uint32_t time) {
+  while (replayActive && (int32_t)(time - replayHeader.time) >= 0) {
+    switch (replayHeader.type) {
+      case TRACE_CLOCK:
+        memcpy(&replayEpoch, replayPayload, sizeof(replayEpoch));
+        replayEpochAt = replayHeader.time;
+        clockSynced = true;  // Same path as an SNTP step
+        break;
+      case TRACE_ENVIRONMENT: {
+        TraceEnvironment env;
+        memcpy(&env, replayPayload, sizeof(env));
+        replayEnvironment.temperature = env.temperature;
+        replayEnvironment.humidity = env.humidity;
+        replayEnvironment.error = env.ok ? NULL : "recorded failure";
+        break;
+      }
+      case TRACE_LIGHT: {
+        uint16_t raw;
+        memcpy(&raw, replayPayload, sizeof(raw));
+        replayLightRaw = raw;
+        replayLightFresh = true;
+        break;
+      }
+      case TRACE_BUTTON:
+        buttonEventQueue.push({replayPayload[0], replayPayload[1], replayHeader.time});
+        break;
+      case TRACE_ALARM_ACTION:
+        alarmEventQueue.push({(AlarmAction)replayPayload[0], micros()});
+        break;
+      case TRACE_CONFIG: {
+        const char* subtopic = (const char*)replayPayload;
+        size_t topicLength = strlen(subtopic) + 1;
+        applyDeviceMessage(subtopic, replayPayload + topicLength, replayHeader.length - topicLength);
+        break;
+      }
+    }
+    replayRecords++;
+    replayActive = readReplayRecord();
+  }
+  if (!replayActive && replayStartedAt != 0) {
+    Serial.print("Replay done: ");
+    Serial.print(replayRecords);
+    Serial.print(" records, ");
+    Serial.print(virtualMillis - replayTraceStart);
+    Serial.print(" ms of trace in ");
+    Serial.print(millis() - replayStartedAt);
+    Serial.println(" ms");
+    replayStartedAt = 0;  // Carries on in real time from here
+  }
+}
+#endif
+#endif
+
+// ESP32 implementation of MediBoxHal.h
+#if TRACE_MODE == TRACE_REPLAY
+uint32_t halMillis() {
+  return virtualMillis;
+}
+
+time_t halTime() {
+  return replayEpoch + (virtualMillis - replayEpochAt) / 1000;
+}
+
+// Jumps straight to the next deadline or trace record, whichever is first
+void halDelay(uint32_t ms) {
+  uint32_t target = virtualMillis + ms;
+  uint32_t due = replayHeader.time;
+  if (!replayActive) {
+    delay(ms);
+  } else if ((int32_t)(due - target) < 0) {
+    target = (int32_t)(due - virtualMillis) > 0 ? due : virtualMillis;
+  }
+  virtualMillis = target;
+  replayUntil(virtualMillis);
+}
+
+bool halReadEnvironment(HalEnvironment& reading) {
+  reading = replayEnvironment;
+  return reading.error == NULL;
+}
+
+#if MEDIBOX_LIGHT_TELEMETRY
+bool halReadLight(int& raw) {
+  if (!replayLightFresh) return false;
+  replayLightFresh = false;
+  raw = replayLightRaw;
+  return true;
+}
+#endif
+#else
+uint32_t halMillis() {
+  return millis();
+}
+
+time_t halTime() {
+  return time(NULL);
+}
+
+void halDelay(uint32_t ms) {
+  delay(ms);
+}
+
+bool halReadEnvironment(HalEnvironment& reading) {
+  TempAndHumidity result = dht.getTempAndHumidity();
+  reading.temperature = result.temperature;
+  reading.humidity = result.humidity;
+  reading.error = NULL;
+  if (dht.getStatus() != DHTesp::ERROR_NONE) {
+    reading.error = dht.getStatusString();
+  }
+#if TRACE_MODE == TRACE_RECORD
+  TraceEnvironment record = {reading.temperature, reading.humidity, reading.error == NULL};
+  traceRecord(TRACE_ENVIRONMENT, &record, sizeof(record), halMillis());
+#endif
+  return reading.error == NULL;
+}
+
+#if MEDIBOX_LIGHT_TELEMETRY
+// In continuous mode this only picks up the latest decimated result
+bool halReadLight(int& raw) {
+#if LDR_CONTINUOUS_ADC
+  if (!ldrConversionDone) return false;
+  ldrConversionDone = false;
+  adc_continuous_data_t* result = NULL;
+  if (!analogContinuousRead(&result, 0)) return false;
+  raw = result[0].avg_read_raw;
+#else
+  raw = analogRead(LDR_PIN);
+#endif
+#if TRACE_MODE == TRACE_RECORD
+  uint16_t record = raw;
+  traceRecord(TRACE_LIGHT, &record, sizeof(record), halMillis());
+#endif
+  return true;
+}
+#endif
+#endif
+
+#if MEDIBOX_SERVO
+void halWriteServo(int angle) {
+  servo.write(angle);
+}
+#endif
+
+void halWriteSignal(uint8_t pin, uint32_t duty) {
+  ledcWrite(pin, duty);
+}